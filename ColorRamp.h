@@ -0,0 +1,72 @@
+/*
+   This file is part of memview, a real-time memory trace visualization
+   application.
+
+   Copyright (C) 2013 Andrew Clinton
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#ifndef ColorRamp_H
+#define ColorRamp_H
+
+#include "Math.h"
+#include "GLImage.h"
+#include <vector>
+
+// 512 size texture to accomodate the 500 possible threads supported by
+// valgrind.
+static const int theColorBits = 9;
+static const int theColorSize = (1 << theColorBits);
+
+// Fill the colors used for threads, data types and memory maps
+void    fillThreadColors(GLImage<uint32> &colors);
+
+// A CPU version of the colour computation in memview.frag, used to render
+// frames without OpenGL.  The two need to be kept in sync.  Dithering is
+// omitted and the texture is assumed to be the size of the window, so the
+// zoomed grid pattern isn't drawn.
+class ColorRamp {
+public:
+     ColorRamp();
+
+    // These correspond to the shader uniforms
+    void    setDisplayMode(int mode)    { myDisplayMode = mode; }
+    void    setDisplayDimmer(bool dim)  { myDisplayDimmer = dim; }
+    void    setTime(uint32 time)        { myTime = time; }
+
+    // Convert an image of state values to 8-bit RGB, stored row by row
+    // from the top.  The display offset and resolution give the bounds of
+    // the layout relative to the image, for drawing the border.
+    void    colorImage(std::vector<uint8> &rgb,
+                       const GLImage<uint32> &state,
+                       int64 offx, int64 offy,
+                       int64 resx, int64 resy) const;
+
+private:
+    void    colorPixel(float clr[3], uint32 val) const;
+    void    threadColor(float clr[3], uint32 idx) const;
+
+private:
+    GLImage<uint32>     myColors;
+    int                 myDisplayMode;
+    bool                myDisplayDimmer;
+    uint32              myTime;
+};
+
+#endif
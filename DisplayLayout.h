@@ -28,7 +28,10 @@
 #include "MemoryState.h"
 #include "Math.h"
 #include "GLImage.h"
+#include "Gather.h"
 #include <vector>
+#include <memory>
+#include <algorithm>
 #include <stdio.h>
 
 
@@ -37,27 +40,47 @@ public:
      DisplayLayout();
     ~DisplayLayout();
 
+    // CACHE is a linear layout where each row holds one line for each set
+    // of a CPU cache, so that each set is displayed in its own columns
     enum Visualization {
         LINEAR,
         BLOCK,
-        HILBERT
+        HILBERT,
+        CACHE
     };
 
     Visualization   getVisualization() const        { return myVisualization; }
+
+    // Returns true for layouts where addresses are displayed in rows
+    bool            isRowLayout() const
+                    {
+                        return myVisualization == LINEAR ||
+                               myVisualization == CACHE;
+                    }
     void            setVisualization(Visualization vis)
                     {
                         myVisualization = vis;
-                        myPrevPageCount = 0; // Force layout update
+                        myRebuild = true; // Force layout update
                     }
 
     void            setCompact(bool compact)
                     {
                         myCompact = compact;
-                        myPrevPageCount = 0; // Force layout update
+                        myRebuild = true; // Force layout update
+                    }
+
+    // Set the number of sets and the line size in bytes for the CACHE
+    // layout
+    void            setCacheGeometry(int64 sets, int64 line)
+                    {
+                        myCacheSets = sets;
+                        myCacheLine = line;
+                        myRebuild = true; // Force layout update
                     }
 
     // Update the block display layout from state. Return true when the layout
-    // changed.
+    // changed.  Only the pages that were created since the last update are
+    // merged into the existing blocks.
     bool            update(MemoryState &state,
                            MMapMap &mmap,
                            int64 winwidth,
@@ -69,6 +92,12 @@ public:
     int64           height() const { return myHeight; }
 
     // Fill an entire image, starting at the given row and column offset.
+    // Large images are split into horizontal bands that are filled in
+    // parallel, each with its own copy of the source.
+    // When clear is false the image is not zeroed first, so only pixels
+    // for pages that the source reports as existing are overwritten.
+    // If dirty is non-null, it has an entry for each image row from the
+    // top that is set to 1 when the row is written.
     // The Source type determines what data is put in the image.  Currently
     // there are explicit instantiations for:
     //        - uint32, StateSource
@@ -78,58 +107,191 @@ public:
     template <typename T, typename Source>
     void            fillImage(GLImage<T> &image,
                           const Source &src,
-                          int64 roff, int64 coff) const;
-
-    // Look up the memory address that corresponds to a given pixel
-    uint64          queryPixelAddress(MemoryState &state,
-                                      int64 roff, int64 coff) const;
+                          int64 roff, int64 coff,
+                          bool clear = true,
+                          uint8 *dirty = 0) const;
+
+    // Look up the memory address that corresponds to a given pixel.
+    // Returns 0 if no address is displayed at the pixel.
+    uint64          queryPixelAddress(int64 roff, int64 coff) const;
+
+    // Look up the memory addresses for every pixel of an image of the given
+    // size, starting at the given row and column offset.  Addresses are
+    // stored row by row from the top of the image.
+    void            queryPixelAddresses(std::vector<uint64> &addrs,
+                                        int64 roff, int64 coff,
+                                        int64 width, int64 height) const;
+
+    // Find the address ranges that are displayed in an image of the given
+    // size, starting at the given row and column offset.  The ranges are
+    // in the address units of the state passed to update() (without
+    // zoom), sorted and merged.
+    void            getVisibleRanges(MemoryState::RangeList &ranges,
+                                     int64 roff, int64 coff,
+                                     int64 width, int64 height) const;
+
+    // Returns true if both layouts have identical blocks and display
+    // boxes.  This is used to test incremental updates.
+    bool            sameBlocks(const DisplayLayout &other) const;
 
 private:
-    // This method handles the compact display mode in 2D
-    template <int dim>
-    void            compactBoxes(int64 &maxval);
+    template <typename T, typename Source> friend class FillBand;
+
+    // Fill a single band of the image on the calling thread
+    template <typename T, typename Source>
+    void            fillBand(GLImage<T> &image,
+                          const Source &src,
+                          int64 roff, int64 coff,
+                          bool clear,
+                          uint8 *dirty) const;
+
+    // Merge newly created pages into myBlocks.  Returns true if any block
+    // changed.
+    bool            mergePages(std::vector<uint64> &pages, uint64 pagesize);
+
+    // Update the single block used when not in compact mode
+    bool            updateFullBlock(MemoryState &state, MMapMap &mmap);
+
+    // Remove the compaction edges of blocks that are no longer valid, and
+    // add edges for the given blocks after they have been laid out
+    void            removeEdges();
+    void            addEdges(const std::vector<int> &blocks);
 
 private:
     struct DisplayBlock {
         DisplayBlock(uint64 addr, uint64 size)
             : myAddr(addr)
-            , mySize(size) {}
+            , mySize(size)
+            , myStateAddr(addr)
+            , myStateSize(size)
+            , mySized(false)
+            , myValid(false) {}
 
         uint64        begin() const { return myAddr; }
         uint64        end() const { return myAddr + mySize; }
+        uint64        stateEnd() const { return myStateAddr + myStateSize; }
+        void          invalidate() { mySized = false; myValid = false; }
 
+        // The address range after zoom
         uint64        myAddr;
         uint64        mySize;
 
         Box<int64>        myBox;
         Box<int64>        myDisplayBox;
+
+        // The address range in the (unzoomed) units of the state, which is
+        // updated incrementally as pages are created
+        uint64        myStateAddr;
+        uint64        myStateSize;
+
+        // The 2D size of the state range, cached while mySized is set
+        Box<int64>        myStateBox;
+
+        // The box before compaction and zoom, which is the source of the
+        // compaction edges
+        Box<int64>        myCompactBox;
+
+        bool              mySized;
+
+        // Cleared when the block needs to be laid out again
+        bool              myValid;
+    };
+
+    // The start or end of a block along one axis.  Edges are ordered by
+    // value with ends before starts, and then by the block address, so that
+    // the order is deterministic and can be maintained incrementally.
+    struct Edge {
+        bool operator<(const Edge &rhs) const
+        {
+            if (myVal != rhs.myVal)
+                return myVal < rhs.myVal;
+            if (myEnd != rhs.myEnd)
+                return myEnd;
+            return myId < rhs.myId;
+        }
+
+        int64   myVal;
+        uint64  myId;
+        bool    myEnd;
     };
 
+    // Merge a page or an existing block onto the end of myBlocks
+    bool            mergePage(uint64 addr, uint64 pagesize);
+    void            appendBlock(const DisplayBlock &block);
+
+    // Find the index of the block with the given state address
+    size_t          findBlock(uint64 addr) const;
+
+    // Compute the address range and box of a block from its state range
+    void            layoutBlock(DisplayBlock &block,
+                                int64 winwidth, int64 rowwidth, int zoom,
+                                int level);
+
+    // This method handles the compact display mode, by sweeping the sorted
+    // edges to assign myDisplayBox.  For dim 1 it also fills myRowIndex.
+    template <int dim>
+    void            compactBoxes(int64 &maxval);
+
+    // Find the blocks whose display box overlaps a row
+    void            findRowBlocks(std::vector<const DisplayBlock *> &blocks,
+                                  int64 row) const;
+
+    // Build the running bounds of myRowIndex for findRowBlocks()
+    void            buildRowIndex();
+
+    // Map a pixel within the display box of a block to its address
+    uint64          blockPixelAddress(const DisplayBlock &block,
+                                      int64 c, int64 r) const;
+
     Visualization                myVisualization;
+
+    // Blocks sorted by address.  These are updated incrementally from the
+    // pages created between updates, and only the blocks that changed are
+    // laid out again.
     std::vector<DisplayBlock>    myBlocks;
+
+    // Indices of myBlocks sorted by the top of the display box, along with
+    // the running maximum of the bottom of the display box, to find the
+    // blocks containing a pixel with a binary search
+    std::vector<int>             myRowIndex;
+    std::vector<int64>           myRowStart;
+    std::vector<int64>           myRowEnd;
+
+    // Sorted compaction edges for each axis
+    std::vector<Edge>            myEdges[2];
+
+    MemoryState::PageCursor      myPageCursor;
+    uint64                       myPageStart;
+    uint64                       myPageEnd;
+    bool                         myRebuild;
+
     int64                        myWidth;
     int64                        myHeight;
     int                          myStartLevel;
     int                          myStopLevel;
     bool                         myCompact;
+    int64                        myCacheSets;
+    int64                        myCacheLine;
 
-    // Key used to determine if an update to myBlocks is needed
-    uint64    myPrevPageCount;
+    // Key used to determine if the blocks need to be laid out again
     int64     myPrevWinWidth;
     int64     myPrevWidth;
     int       myPrevZoom;
 };
 
-// Fill State values from the given MemoryState
+// Fill State values from the given MemoryState.  If since is non-zero, only
+// pages that were modified at or after that generation are filled.
 class StateSource {
 public:
-    StateSource(MemoryState &state) : myState(state) {}
+    StateSource(MemoryState &state, uint32 since = 0)
+        : myState(state)
+        , mySince(since) {}
 
     MemoryState::DisplayPage getPage(uint64 addr, uint64, uint64 &off) const
     { return myState.getPage(addr, off); }
 
     inline bool exists(const MemoryState::DisplayPage &page) const
-    { return page.exists(); }
+    { return page.exists() && page.stamp() >= mySince; }
 
     inline void setScanline(uint32 *scan,
             MemoryState::DisplayPage &page, uint64 off, int n) const
@@ -140,13 +302,13 @@ public:
             MemoryState::DisplayPage &page, uint64 off,
             const int *lut, int n) const
     {
-        const uint32        *state = (const uint32 *)page.stateArray() + off;
-        for (int i = 0; i < n; i++)
-            scan[i] = state[lut[i]];
+        gatherIndexed(scan, (const uint32 *)page.stateArray() + off,
+                lut, n, 0);
     }
 
 private:
     MemoryState        &myState;
+    uint32              mySince;
 };
 
 // Fill State values from the given MemoryState, sampling based on the given
@@ -181,17 +343,17 @@ public:
     inline void setScanline(uint32 *scan,
             Page &page, uint64 off, int n) const
     {
-        const uint32        *state = (const uint32 *)page.myPage.stateArray() + (off << myZoom);
-        for (int i = 0; i < n; i++)
-            scan[i] = state[i << myZoom];
+        gatherStrided(scan,
+                (const uint32 *)page.myPage.stateArray() + (off << myZoom),
+                n, myZoom);
     }
     inline void gatherScanline(uint32 *scan,
             Page &page, uint64 off,
             const int *lut, int n) const
     {
-        const uint32        *state = (const uint32 *)page.myPage.stateArray() + (off << myZoom);
-        for (int i = 0; i < n; i++)
-            scan[i] = state[lut[i] << myZoom];
+        gatherIndexed(scan,
+                (const uint32 *)page.myPage.stateArray() + (off << myZoom),
+                lut, n, myZoom);
     }
 
 private:
@@ -228,101 +390,310 @@ private:
     MemoryState        &myState;
 };
 
+// Intervals from a snapshot of an interval map, collapsed into sorted runs
+// of display pixels.  Intervals smaller than a pixel are merged, with the
+// last interval overlapping a pixel taking precedence.  The runs are kept
+// between frames.  When only the snapshot has changed, just the address
+// ranges that the writers touched are rebuilt.
+template <typename T>
+class IntervalRuns {
+public:
+    struct Run {
+        uint64      myStart;
+        uint64      myEnd;
+        uint32      myIdx;
+    };
+    typedef std::vector<Run> RunList;
+
+    IntervalRuns()
+        : mySelection(0)
+        , myIgnoreBits(-1) {}
+
+    // These are the values used by the fragment shader
+    static inline uint32 getIndex(const MMapInfo &info, bool)
+    { return info.myIdx; }
+    static inline uint32 getIndex(const StackInfo &info, bool selected)
+    { return selected ? 1 : info.myState; }
+
+    std::shared_ptr<const RunList> getRuns(const IntervalMap<T> &intervals,
+                                           uint64 selection, int ignorebits)
+    {
+        std::unique_ptr<IntervalMapReader<T>> reader(
+                new IntervalMapReader<T>(intervals));
+
+        if (myRuns && selection == mySelection && ignorebits == myIgnoreBits)
+        {
+            if (reader->isSameVersion(*myReader))
+                return myRuns;
+
+            std::vector<std::pair<uint64, uint64>> ranges;
+            reader->getChangedRanges(*myReader, ranges);
+
+            // Merge the new runs for the changed ranges with the unchanged
+            // runs
+            const RunList  &runs = *myRuns;
+            size_t          cursor = 0;
+
+            myScratch.clear();
+            for (size_t i = 0; i < ranges.size(); )
+            {
+                const uint64 a = (1ull << ignorebits) - 1;
+                uint64 p0 = ranges[i].first >> ignorebits;
+                uint64 p1 = (ranges[i].second + a) >> ignorebits;
+
+                // Ranges can share pixels once they're rounded
+                for (i++; i < ranges.size() &&
+                        (ranges[i].first >> ignorebits) < p1; i++)
+                    p1 = (ranges[i].second + a) >> ignorebits;
+
+                updateRuns(myScratch, runs, cursor, *reader, p0, p1);
+            }
+            copyRuns(myScratch, runs, cursor, runs.size());
+
+            // The runs can be replaced in place once no fill is using them
+            if (myRuns.use_count() > 1)
+                myRuns.reset(new RunList(myScratch));
+            else
+            {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                myRuns->swap(myScratch);
+            }
+        }
+        else
+        {
+            mySelection = selection;
+            myIgnoreBits = ignorebits;
+            myRuns.reset(new RunList);
+            buildRuns(*myRuns, *reader, reader->begin(), ~0ull);
+        }
+
+        myReader = std::move(reader);
+
+        return myRuns;
+    }
+
+private:
+    typedef typename IntervalMapReader<T>::iterator iterator;
+
+    // Add the runs for intervals from it until the first interval starting
+    // at or after end
+    void buildRuns(RunList &runs, const IntervalMapReader<T> &reader,
+                   iterator it, uint64 end) const
+    {
+        const uint64 a = (1ull << myIgnoreBits) - 1;
+
+        for (; it != reader.end() && it.start() < end; ++it)
+        {
+            uint64  start = it.start() >> myIgnoreBits;
+            uint32  idx = getIndex(it.value(), mySelection == it.start());
+
+            // Overwrite the pixel shared with earlier intervals
+            while (!runs.empty() && runs.back().myEnd > start)
+            {
+                if (runs.back().myStart < start)
+                    runs.back().myEnd = start;
+                else
+                    runs.pop_back();
+            }
+
+            appendRun(runs, Run{start, (it.end() + a) >> myIgnoreBits, idx});
+        }
+    }
+
+    static void appendRun(RunList &runs, const Run &run)
+    {
+        if (run.myStart >= run.myEnd)
+            return;
+        if (!runs.empty() && runs.back().myEnd == run.myStart &&
+            runs.back().myIdx == run.myIdx)
+            runs.back().myEnd = run.myEnd;
+        else
+            runs.push_back(run);
+    }
+
+    // Append the unchanged runs in [first, last), merging the first run
+    // with the last run in out
+    static void copyRuns(RunList &out, const RunList &runs,
+                         size_t first, size_t last)
+    {
+        if (first < last)
+        {
+            appendRun(out, runs[first]);
+            out.insert(out.end(), runs.begin() + first+1,
+                    runs.begin() + last);
+        }
+    }
+
+    // Append the runs before pixel p0 that haven't been copied yet, followed
+    // by new runs for the pixels in [p0, p1)
+    void updateRuns(RunList &out, const RunList &runs, size_t &cursor,
+                    const IntervalMapReader<T> &reader,
+                    uint64 p0, uint64 p1) const
+    {
+        size_t first = std::upper_bound(runs.begin() + cursor, runs.end(),
+                p0, EndCompare()) - runs.begin();
+        size_t last = std::lower_bound(runs.begin() + first, runs.end(), p1,
+                StartCompare()) - runs.begin();
+
+        copyRuns(out, runs, cursor, first);
+        cursor = last;
+
+        // Keep the parts of the overlapping runs outside the pixels
+        Run     left = Run{0, 0, 0};
+        Run     right = Run{0, 0, 0};
+        if (first < last && runs[first].myStart < p0)
+            left = Run{runs[first].myStart, p0, runs[first].myIdx};
+        if (first < last && runs[last-1].myEnd > p1)
+            right = Run{p1, runs[last-1].myEnd, runs[last-1].myIdx};
+
+        RunList mid;
+        buildRuns(mid, reader, reader.findAfter(p0 << myIgnoreBits),
+                p1 << myIgnoreBits);
+
+        appendRun(out, left);
+        for (auto it = mid.begin(); it != mid.end(); ++it)
+            appendRun(out, Run{SYSmax(it->myStart, p0),
+                    SYSmin(it->myEnd, p1), it->myIdx});
+        appendRun(out, right);
+    }
+
+    struct EndCompare {
+        bool operator()(uint64 addr, const Run &run) const
+        { return addr < run.myEnd; }
+    };
+    struct StartCompare {
+        bool operator()(const Run &run, uint64 addr) const
+        { return run.myStart < addr; }
+    };
+
+private:
+    // Holds the version of the map that the runs were built from
+    std::unique_ptr<IntervalMapReader<T>>   myReader;
+    std::shared_ptr<RunList>                myRuns;
+    RunList                                 myScratch;
+    uint64                                  mySelection;
+    int                                     myIgnoreBits;
+};
+
 // Fill indices representing which MMap segment each mapped address
-// corresponds to
+// corresponds to.  Pages are requested in increasing address order within
+// a display block, so a cursor into the runs avoids searching for each
+// page, and runs are written directly into the scanlines.
 template <typename T>
 class IntervalSource {
+    typedef typename IntervalRuns<T>::Run     Run;
+    typedef typename IntervalRuns<T>::RunList RunList;
 public:
-    IntervalSource(const IntervalMap<T> &intervals,
+    IntervalSource(IntervalRuns<T> &runs,
+            const IntervalMap<T> &intervals,
             uint64 selection, int ignorebits)
-        : myIntervals(intervals)
-        , mySelection(selection)
-        , myIgnoreBits(ignorebits)
+        : myRuns(runs.getRuns(intervals, selection, ignorebits))
+        , myCursor(0)
         {}
 
     struct Page {
-        Page() : mySize(0), myExists(false) {}
-        Page(uint64 size, bool exists)
-            : mySize(size)
-            , myExists(exists) {}
+        Page(uint64 addr, uint64 size, size_t first, bool exists)
+            : myAddr(addr)
+            , mySize(size)
+            , myFirst(first)
+            , myExists(exists)
+            , myFilled(false) {}
 
         uint64 size() const { return mySize; }
 
+        uint64      myAddr;
         uint64      mySize;
+        size_t      myFirst;
         bool        myExists;
+        bool        myFilled;
     };
 
-    // These are the values used by the fragment shader
-    static inline int getIndex(const MMapInfo &info, bool)
-    { return info.myIdx; }
-    static inline int getIndex(const StackInfo &info, bool selected)
-    { return selected ? 1 : info.myState; }
-
     Page getPage(uint64 addr, uint64 size, uint64 &off) const
     {
-        IntervalMapReader<T> reader(myIntervals);
-        auto it = reader.findAfter(addr << myIgnoreBits);
+        const RunList  &runs = *myRuns;
 
         off = 0;
 
-        // addr does not overlap the range - return an empty page
-        if (it == reader.end() || (it.start()>>myIgnoreBits) >= addr + size)
-            return Page(size, false);
-
-        myBuffer.assign(size, 0);
-
-        while ((it.start()>>myIgnoreBits) < addr + size)
+        // Find the first run ending after addr.  Most often this is a
+        // short step forward from the previous page.
+        if (myCursor > 0 && runs[myCursor-1].myEnd > addr)
+            myCursor = findRun(addr);
+        for (int i = 0; myCursor < runs.size() &&
+                runs[myCursor].myEnd <= addr; i++)
         {
-            const uint64        a = (1ull << myIgnoreBits) - 1;
-            const bool          selected = mySelection == it.start();
-            uint64              start = it.start() >> myIgnoreBits;
-            uint64              end = (it.end()+a) >> myIgnoreBits;
-
-            start = SYSmax(start, addr);
-
-            for (uint64 i = start-addr; i < SYSmin(end-addr, size); i++)
-                myBuffer[i] = getIndex(it.value(), selected);
-
-            ++it;
-            if (it == reader.end())
-                break;
-
-            // When zoomed out there may be many intervals overlapping a
-            // single pixel.  Check if the next interval would end at the
-            // same address and if so perform another binary search to
-            // advance to the next pixel.
-            if (((it.end()+a)>>myIgnoreBits) == end)
+            if (i == 8)
             {
-                it = reader.findAfter(end << myIgnoreBits);
-                if (it == reader.end())
-                    break;
+                myCursor = findRun(addr);
+                break;
             }
+            myCursor++;
         }
 
-        return Page(size, true);
+        bool exists = myCursor < runs.size() &&
+            runs[myCursor].myStart < addr + size;
+
+        return Page(addr, size, myCursor, exists);
     }
 
     inline bool exists(const Page &page) const { return page.myExists; }
 
-    inline void setScanline(uint32 *scan, Page &, uint64 off, int n) const
+    inline void setScanline(uint32 *scan, Page &page, uint64 off, int n) const
     {
-        memcpy(scan, &myBuffer[off], n*sizeof(uint32));
+        const RunList  &runs = *myRuns;
+        uint64          addr = page.myAddr + off;
+        uint64          end = addr + n;
+
+        for (size_t i = page.myFirst; i < runs.size() && addr < end; i++)
+        {
+            const Run  &run = runs[i];
+            if (run.myEnd <= addr)
+                continue;
+
+            uint64  start = SYSclamp(run.myStart, addr, end);
+            uint64  stop = SYSmin(run.myEnd, end);
+
+            std::fill(scan, scan + (start - addr), 0);
+            std::fill(scan + (start - addr), scan + (stop - addr), run.myIdx);
+
+            scan += stop - addr;
+            addr = stop;
+        }
+
+        std::fill(scan, scan + (end - addr), 0);
     }
 
     inline void gatherScanline(uint32 *scan,
-                               Page &, uint64 off,
+                               Page &page, uint64 off,
                                const int *lut, int n) const
     {
-        const uint32        *state = &myBuffer[off];
-        for (int i = 0; i < n; i++)
-            scan[i] = state[lut[i]];
+        // Blocks in the 2D layouts are gathered in a permuted order, so
+        // the block is written out once and gathered from for each row
+        if (!page.myFilled)
+        {
+            myBuffer.resize(page.size());
+            setScanline(myBuffer.data(), page, 0, page.size());
+            page.myFilled = true;
+        }
+        gatherIndexed(scan, &myBuffer[off], lut, n, 0);
+    }
+
+private:
+    size_t  findRun(uint64 addr) const
+    {
+        const RunList  &runs = *myRuns;
+        return std::upper_bound(runs.begin(), runs.end(), addr,
+                [] (uint64 a, const Run &run) { return a < run.myEnd; }) -
+            runs.begin();
     }
 
 private:
-    const IntervalMap<T>          &myIntervals;
-    mutable std::vector<uint32>    myBuffer;
-    uint64                         mySelection;
-    int                            myIgnoreBits;
+    // The same runs are used for the entire image
+    std::shared_ptr<const RunList>  myRuns;
+
+    // The cursor and block buffer are per thread, since the source is
+    // copied for each thread that fills part of an image
+    mutable size_t                  myCursor;
+    mutable std::vector<uint32>     myBuffer;
 };
 
 #endif
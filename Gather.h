@@ -0,0 +1,72 @@
+/*
+   This file is part of memview, a real-time memory trace visualization
+   application.
+
+   Copyright (C) 2013 Andrew Clinton
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#ifndef Gather_H
+#define Gather_H
+
+#include "Math.h"
+
+// Kernels to copy scanlines of 32-bit values into an image.  SIMD versions
+// are selected at startup when the CPU supports them.
+
+typedef void (*GatherIndexedFunc)(uint32 *dst, const uint32 *src,
+                                  const int *idx, int n, int shift);
+typedef void (*GatherStridedFunc)(uint32 *dst, const uint32 *src,
+                                  int n, int shift);
+
+extern GatherIndexedFunc    theGatherIndexed;
+extern GatherStridedFunc    theGatherStrided;
+
+// Enable or disable the SIMD kernels, for benchmarking.  Returns false if
+// they are not supported.
+bool    gatherUseSIMD(bool enable);
+
+// dst[i] = src[idx[i] << shift] for i < n
+inline void
+gatherIndexed(uint32 *dst, const uint32 *src, const int *idx, int n, int shift)
+{
+    // Short rows are the smaller Hilbert or block levels
+    if (n < 8)
+    {
+        for (int i = 0; i < n; i++)
+            dst[i] = src[idx[i] << shift];
+        return;
+    }
+    theGatherIndexed(dst, src, idx, n, shift);
+}
+
+// dst[i] = src[i << shift] for i < n
+inline void
+gatherStrided(uint32 *dst, const uint32 *src, int n, int shift)
+{
+    if (n < 8)
+    {
+        for (int i = 0; i < n; i++)
+            dst[i] = src[i << shift];
+        return;
+    }
+    theGatherStrided(dst, src, n, shift);
+}
+
+#endif
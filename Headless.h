@@ -0,0 +1,85 @@
+/*
+   This file is part of memview, a real-time memory trace visualization
+   application.
+
+   Copyright (C) 2013 Andrew Clinton
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#ifndef Headless_H
+#define Headless_H
+
+#include <QObject>
+#include "Math.h"
+#include "GLImage.h"
+#include "ColorRamp.h"
+#include "DisplayLayout.h"
+#include "IntervalMap.h"
+#include <string>
+#include <vector>
+
+class Loader;
+class MemoryState;
+class LocalityReport;
+
+// Runs the loader without a window, periodically writing the display to
+// numbered image files and/or writing a report of access statistics when
+// the trace ends.  This only requires a QCoreApplication, so it can be
+// used without an X server or GPU.
+class Headless : public QObject {
+public:
+             Headless(int argc, char *argv[]);
+    virtual ~Headless();
+
+    // Returns false if the options were invalid or the trace couldn't be
+    // started
+    bool            isValid() const { return myValid; }
+
+protected:
+    virtual void    timerEvent(QTimerEvent *event);
+
+private:
+    void            renderFrame();
+    bool            writeFrame();
+
+private:
+    DisplayLayout           myDisplay;
+    ColorRamp               myColorRamp;
+    GLImage<uint32>         myImage;
+    std::vector<uint8>      myRGB;
+
+    MemoryState            *myState;
+    // Downsampled for zoom > 0, and owned by the loader
+    MemoryState            *myZoomState;
+    StackTraceMap          *myStackTrace;
+    MMapMap                *myMMapMap;
+    Loader                 *myLoader;
+    LocalityReport         *myReport;
+    std::string             myPath;
+
+    std::string             myFramesOut;
+    std::string             myReportOut;
+    bool                    myPPM;
+    int                     myZoom;
+    int                     myFrame;
+    int                     myTimer;
+    bool                    myValid;
+};
+
+#endif
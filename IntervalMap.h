@@ -26,9 +26,13 @@
 #define IntervalMap_H
 
 #include <QMutex>
+#include <QAtomicInt>
 #include "Math.h"
 #include <unordered_set>
-#include <map>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
 #include <string>
 #include <assert.h>
 #include <iostream>
@@ -36,46 +40,399 @@
 template <typename T> class IntervalMapReader;
 template <typename T> class IntervalMapWriter;
 
+// An immutable string stored in a global table.  Equal strings share the
+// same storage, so copies and comparisons only involve a pointer.  Strings
+// are removed from the table when the last reference is released.
+class InternString {
+public:
+    InternString();
+    InternString(const char *str);
+    InternString(const std::string &str);
+
+    const std::string  &str() const { return *myStr; }
+    const char         *c_str() const { return myStr->c_str(); }
+    operator            const std::string &() const { return *myStr; }
+
+    bool    operator==(const InternString &rhs) const
+            { return myStr == rhs.myStr; }
+    bool    operator!=(const InternString &rhs) const
+            { return myStr != rhs.myStr; }
+
+    // The number of unique strings and their approximate memory use in
+    // bytes
+    static size_t   getCount();
+    static size_t   getMemoryUsage();
+
+private:
+    std::shared_ptr<const std::string>  myStr;
+};
+
+// Non-overlapping intervals sorted by address, stored in chunks of
+// contiguous entries.  Chunks are shared between copies of the array and
+// copied on the first write, so that copying the array only copies the
+// chunk pointers.
+template <typename T>
+class IntervalArray {
+public:
+    struct Entry {
+        uint64   start;
+        uint64   end;
+        T        obj;
+    };
+
+private:
+    typedef std::vector<Entry>      Chunk;
+    typedef std::shared_ptr<Chunk>  ChunkPtr;
+
+    // Chunks are split when they grow to twice this size
+    static const size_t theChunkSize = 128;
+
+    struct EndCompare {
+        bool operator()(uint64 addr, const Entry &e) const
+        { return addr < e.end; }
+    };
+
+public:
+    IntervalArray() : mySize(0) {}
+
+    size_t  size() const { return mySize; }
+
+    class const_iterator {
+    public:
+        const_iterator(const IntervalArray *arr, size_t chunk, size_t idx)
+            : myArray(arr), myChunk(chunk), myIdx(idx) {}
+
+        const Entry &operator*() const
+                     { return (*myArray->myChunks[myChunk])[myIdx]; }
+        const Entry *operator->() const { return &operator*(); }
+
+        const_iterator &operator++()
+        {
+            if (++myIdx == myArray->myChunks[myChunk]->size())
+            {
+                myChunk++;
+                myIdx = 0;
+            }
+            return *this;
+        }
+        const_iterator &operator--()
+        {
+            if (!myIdx)
+            {
+                myChunk--;
+                myIdx = myArray->myChunks[myChunk]->size();
+            }
+            myIdx--;
+            return *this;
+        }
+
+        bool operator==(const const_iterator &rhs) const
+        { return myChunk == rhs.myChunk && myIdx == rhs.myIdx; }
+        bool operator!=(const const_iterator &rhs) const
+        { return !operator==(rhs); }
+
+    private:
+        friend class IntervalArray;
+
+        const IntervalArray *myArray;
+        size_t               myChunk;
+        size_t               myIdx;
+    };
+
+    const_iterator  begin() const { return const_iterator(this, 0, 0); }
+    const_iterator  end() const
+                    { return const_iterator(this, myChunks.size(), 0); }
+
+    // Returns the first interval that ends after addr
+    const_iterator  upper_bound(uint64 addr) const
+    {
+        size_t c = std::upper_bound(myChunkEnd.begin(), myChunkEnd.end(),
+                addr) - myChunkEnd.begin();
+        if (c == myChunks.size())
+            return end();
+
+        const Chunk &chunk = *myChunks[c];
+        size_t i = std::upper_bound(chunk.begin(), chunk.end(),
+                addr, EndCompare()) - chunk.begin();
+        return const_iterator(this, c, i);
+    }
+
+    // Split the interval containing addr so that addr is on an interval
+    // boundary
+    void    split(uint64 addr)
+    {
+        const_iterator it = upper_bound(addr);
+        if (it == end() || it->start >= addr)
+            return;
+
+        Entry first = *it;
+        first.end = addr;
+        get(it).start = addr;
+        insert(it, first);
+    }
+
+    // Insert an entry before the given position
+    void    insert(const_iterator pos, const Entry &e)
+    {
+        if (myChunks.empty())
+        {
+            myChunks.push_back(ChunkPtr(new Chunk));
+            myChunkEnd.push_back(0);
+            pos = begin();
+        }
+        else if (pos == end())
+        {
+            pos.myChunk = myChunks.size()-1;
+            pos.myIdx = myChunks.back()->size();
+        }
+
+        const size_t c = pos.myChunk;
+        Chunk       &chunk = writeChunk(c);
+
+        chunk.insert(chunk.begin() + pos.myIdx, e);
+        mySize++;
+
+        if (chunk.size() >= 2*theChunkSize)
+        {
+            ChunkPtr next(new Chunk(chunk.begin() + theChunkSize,
+                        chunk.end()));
+            chunk.resize(theChunkSize);
+
+            myChunks.insert(myChunks.begin() + c+1, next);
+            myChunkEnd.insert(myChunkEnd.begin() + c+1, next->back().end);
+        }
+
+        myChunkEnd[c] = chunk.back().end;
+    }
+
+    // Erase the entries in [first, last)
+    void    erase(const_iterator first, const_iterator last)
+    {
+        // Work backwards so that removing chunks doesn't move the
+        // remaining positions
+        for (size_t c = SYSmin(last.myChunk+1, myChunks.size());
+                c-- > first.myChunk; )
+        {
+            size_t lo = c == first.myChunk ? first.myIdx : 0;
+            size_t hi = c == last.myChunk ? last.myIdx : myChunks[c]->size();
+            if (lo >= hi)
+                continue;
+
+            Chunk &chunk = writeChunk(c);
+
+            chunk.erase(chunk.begin() + lo, chunk.begin() + hi);
+            mySize -= hi - lo;
+
+            if (chunk.empty())
+            {
+                myChunks.erase(myChunks.begin() + c);
+                myChunkEnd.erase(myChunkEnd.begin() + c);
+            }
+            else
+                myChunkEnd[c] = chunk.back().end;
+        }
+    }
+
+    // Erase all entries for which pred(entry) is true
+    template <typename Pred>
+    void    eraseIf(const Pred &pred)
+    {
+        for (size_t c = myChunks.size(); c-- > 0; )
+        {
+            Chunk &chunk = writeChunk(c);
+            size_t n = chunk.size();
+
+            chunk.erase(std::remove_if(chunk.begin(), chunk.end(), pred),
+                    chunk.end());
+            mySize -= n - chunk.size();
+
+            if (chunk.empty())
+            {
+                myChunks.erase(myChunks.begin() + c);
+                myChunkEnd.erase(myChunkEnd.begin() + c);
+            }
+            else
+                myChunkEnd[c] = chunk.back().end;
+        }
+    }
+
+    // The approximate memory used by the entries, in bytes
+    size_t  getMemoryUsage() const
+    {
+        size_t bytes = myChunks.size() * (sizeof(ChunkPtr) + sizeof(uint64));
+        for (size_t c = 0; c < myChunks.size(); c++)
+            bytes += myChunks[c]->capacity() * sizeof(Entry);
+        return bytes;
+    }
+
+    // Find the address ranges that may have changed since prev, which is
+    // an earlier copy of this array.  Chunks are copied when they are
+    // written, so only the chunks that aren't shared with prev need to be
+    // compared.  Each range covers a chunk along with the gap before it.
+    void    getChangedRanges(const IntervalArray &prev,
+                    std::vector<std::pair<uint64, uint64>> &ranges) const
+    {
+        std::unordered_set<const Chunk *>   cur;
+        std::unordered_set<const Chunk *>   old;
+
+        for (size_t c = 0; c < myChunks.size(); c++)
+            cur.insert(myChunks[c].get());
+        for (size_t c = 0; c < prev.myChunks.size(); c++)
+            old.insert(prev.myChunks[c].get());
+
+        ranges.clear();
+        prev.appendUnshared(cur, ranges);
+        appendUnshared(old, ranges);
+
+        if (ranges.empty())
+            return;
+
+        // Sort and merge the ranges from both arrays
+        std::sort(ranges.begin(), ranges.end());
+
+        size_t n = 0;
+        for (size_t i = 1; i < ranges.size(); i++)
+        {
+            if (ranges[i].first <= ranges[n].second)
+                ranges[n].second = SYSmax(ranges[n].second,
+                        ranges[i].second);
+            else
+                ranges[++n] = ranges[i];
+        }
+        ranges.resize(n+1);
+    }
+
+    // Writable access to an entry.  The end address must not be changed.
+    Entry  &get(const_iterator pos)
+    {
+        return writeChunk(pos.myChunk)[pos.myIdx];
+    }
+
+private:
+    void    appendUnshared(const std::unordered_set<const Chunk *> &other,
+                    std::vector<std::pair<uint64, uint64>> &ranges) const
+    {
+        for (size_t c = 0; c < myChunks.size(); c++)
+        {
+            if (!other.count(myChunks[c].get()))
+                ranges.push_back(std::make_pair(
+                            c ? myChunkEnd[c-1] : 0, myChunkEnd[c]));
+        }
+    }
+
+    Chunk  &writeChunk(size_t c)
+    {
+        if (myChunks[c].use_count() > 1)
+            myChunks[c] = ChunkPtr(new Chunk(*myChunks[c]));
+        else
+        {
+            // Other copies that shared the chunk may have just been
+            // released.  Make sure their reads are complete.
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        return *myChunks[c];
+    }
+
+private:
+    std::vector<ChunkPtr>   myChunks;
+
+    // The end of the last interval in each chunk
+    std::vector<uint64>     myChunkEnd;
+    size_t                  mySize;
+};
+
 // This class stores a map of non-overlapping intervals [start, end).  The
 // manipulator methods ensure that the interval map is always
 // non-overlapping.  Access is through IntervalMapReader and
 // IntervalMapWriter to guarantee thread-safety.
+//
+// Readers see an immutable snapshot of the map and never block.  Writers
+// modify a separate copy under a lock, and the changes are published as a
+// new snapshot by the next reader that finds the writer lock free, or by
+// the next writer to finish if a reader found the lock held.  This batches
+// the changes from any number of writers between reads.  Since
+// the array shares unmodified chunks, a snapshot only copies the chunks
+// that were written since the last one.
 template <typename T>
 class IntervalMap {
+public:
+    IntervalMap()
+        : mySnapshot(new MapType)
+        , myDirty(0)
+        , myPublishRequest(0) {}
+
 private:
     friend class IntervalMapReader<T>;
     friend class IntervalMapWriter<T>;
 
-    struct Entry {
-        uint64   start;
-        T        obj;
-    };
+    typedef IntervalArray<T> MapType;
+    typedef std::shared_ptr<const MapType> SnapshotType;
 
-    typedef std::map<uint64, Entry> MapType;
+    SnapshotType    snapshot() const
+    {
+        if (myDirty.load())
+        {
+            if (myLock.tryLock())
+            {
+                publish();
+                myLock.unlock();
+            }
+            else
+                myPublishRequest.store(1);
+        }
+        return std::atomic_load(&mySnapshot);
+    }
 
-    MapType           myMap;
-    mutable QMutex    myLock;
+    // Must be called with myLock held
+    void            publish() const
+    {
+        std::atomic_store(&mySnapshot, SnapshotType(new MapType(myMap)));
+        myDirty.store(0);
+        myPublishRequest.store(0);
+    }
+
+    MapType                 myMap;
+    mutable SnapshotType    mySnapshot;
+    mutable QAtomicInt      myDirty;
+    mutable QAtomicInt      myPublishRequest;
+    mutable QMutex          myLock;
 };
 
-// This class locks access to the interval map, so scope it appropriately.
-// This allows multiple operations on the map within the same lock
+// This class holds a snapshot of the interval map, so scope it
+// appropriately.  Changes made after the reader was created are not
+// visible.  Readers are cheap to create and copy.
 template <typename T>
 class IntervalMapReader {
     typedef typename IntervalMap<T>::MapType MapType;
+    typedef typename IntervalMap<T>::SnapshotType SnapshotType;
 public:
     IntervalMapReader(const IntervalMap<T> &imap)
-        : myMap(imap.myMap)
-        , myLock(&imap.myLock) {}
+        : mySnapshot(imap.snapshot())
+        , myMap(mySnapshot.get()) {}
 
-    size_t  size() const { return myMap.size(); }
+    size_t  size() const { return myMap->size(); }
+
+    // The approximate memory used by the map, in bytes.  This doesn't
+    // include memory referenced by the values.
+    size_t  getMemoryUsage() const { return myMap->getMemoryUsage(); }
+
+    // Returns true if both readers see the same version of the map
+    bool    isSameVersion(const IntervalMapReader &other) const
+            { return myMap == other.myMap; }
+
+    // Find the sorted address ranges where this version of the map may
+    // differ from the version seen by prev
+    void    getChangedRanges(const IntervalMapReader &prev,
+                    std::vector<std::pair<uint64, uint64>> &ranges) const
+            { myMap->getChangedRanges(*prev.myMap, ranges); }
 
     class iterator {
     public:
         iterator(typename MapType::const_iterator it) : myIt(it) {}
 
-        uint64         start() const { return myIt->second.start; }
-        uint64         end() const { return myIt->first; }
-        const T       &value() const { return myIt->second.obj; }
+        uint64         start() const { return myIt->start; }
+        uint64         end() const { return myIt->end; }
+        const T       &value() const { return myIt->obj; }
 
         iterator& operator++() { ++myIt; return *this; }
         iterator operator++(int)
@@ -89,30 +446,21 @@ public:
         typename MapType::const_iterator   myIt;
     };
 
-    iterator        begin() const { return iterator(myMap.begin()); }
-    iterator        end() const { return iterator(myMap.end()); }
+    iterator        begin() const { return iterator(myMap->begin()); }
+    iterator        end() const { return iterator(myMap->end()); }
 
     // Finds the element above and below the query address, and returns the
     // closer of the two.
     iterator    findClosest(uint64 addr) const
     {
-        auto hi = myMap.upper_bound(addr);
-        if (hi != myMap.end())
+        auto hi = myMap->upper_bound(addr);
+        if (hi != myMap->begin())
         {
             auto lo = hi;
             --lo;
 
-            if (lo != myMap.end() &&
-                    dist2(hi, addr) > dist2(lo, addr))
+            if (hi == myMap->end() || dist2(hi, addr) > dist2(lo, addr))
                 hi = lo;
-
-            return iterator(hi);
-        }
-        else if (myMap.size())
-        {
-            auto lo = hi;
-            --lo;
-            return iterator(lo);
         }
 
         return iterator(hi);
@@ -130,16 +478,19 @@ public:
     // that contains addr.
     iterator    findAfter(uint64 addr) const
     {
-        return iterator(myMap.upper_bound(addr));
+        return iterator(myMap->upper_bound(addr));
     }
 
     // Return the entire interval covered by the map
     void    getTotalInterval(uint64 &start, uint64 &end) const
     {
-        if (myMap.size())
+        if (myMap->size())
         {
-            start = myMap.begin()->second.start;
-            end = myMap.rbegin()->first;
+            auto last = myMap->end();
+            --last;
+
+            start = myMap->begin()->start;
+            end = last->end;
         }
         else
         {
@@ -150,48 +501,73 @@ public:
 
     void    dump() const
     {
-        for (auto it = myMap.begin(); it != myMap.end(); ++it)
+        for (auto it = myMap->begin(); it != myMap->end(); ++it)
         {
             std::cerr
-                << "[" << it->second.start
-                << ", " << it->first << "): "
-                << it->second.obj << "\n";
+                << "[" << it->start
+                << ", " << it->end << "): "
+                << it->obj << "\n";
         }
     }
 
+protected:
+    // Writers read from the map that they are modifying
+    explicit IntervalMapReader(const MapType &map)
+        : myMap(&map) {}
+
 private:
     // Find the distance from an address to an interval
     template <typename IT>
     uint64 dist2(const IT &e, uint64 addr) const
     {
-        if (addr < e->second.start)
-            return e->second.start - addr;
-        if (addr >= e->first)
-            return addr - e->first + 1;
+        if (addr < e->start)
+            return e->start - addr;
+        if (addr >= e->end)
+            return addr - e->end + 1;
         return 0;
     }
 
 private:
-    const MapType   &myMap;
-    QMutexLocker     myLock;
+    SnapshotType     mySnapshot;
+    const MapType   *myMap;
 };
 
-// This class locks access to the interval map, so scope it appropriately.
-// This allows multiple operations on the map within the same lock
+// This class locks the interval map for writing, so scope it
+// appropriately.  This allows multiple operations on the map within the
+// same lock.  The changes are visible to readers created after a later
+// snapshot is published.
 template <typename T>
 class IntervalMapWriter : public IntervalMapReader<T> {
     typedef typename IntervalMap<T>::MapType MapType;
 public:
     IntervalMapWriter(IntervalMap<T> &imap)
-        : IntervalMapReader<T>(imap)
-        , myMap(imap.myMap) {}
+        : IntervalMapReader<T>(imap.myMap)
+        , myIntervals(imap)
+        , myMap(imap.myMap)
+        , myLock(&imap.myLock) {}
+    ~IntervalMapWriter()
+    {
+        myIntervals.myDirty.store(1);
+        if (myIntervals.myPublishRequest.load())
+            publish();
+    }
+
+    // Publish the changes made so far, so that they're visible to new
+    // readers
+    void    publish()
+    {
+        myIntervals.publish();
+    }
 
     void    insert(uint64 start, uint64 end, const T &val)
     {
+        if (start >= end)
+            return;
+
         clearOverlappingIntervals(start, end);
 
-        myMap[end].start = start;
-        myMap[end].obj = val;
+        myMap.insert(myMap.upper_bound(start),
+                typename MapType::Entry{start, end, val});
     }
 
     void    erase(uint64 start, uint64 end)
@@ -205,52 +581,66 @@ public:
     template <typename Func>
     void    apply(uint64 start, uint64 end, const Func func)
     {
-        typename MapType::iterator first, last;
-        getOverlappingIntervals(start, end, first, last);
+        myMap.split(start);
+        myMap.split(end);
 
-        for (; first != last; ++first)
-            func(first->second.obj);
+        for (auto it = myMap.upper_bound(start);
+                it != myMap.end() && it->start < end; ++it)
+            func(myMap.get(it).obj);
     }
 
-private:
-    // Find all intervals that overlap [start, end).  If any intervals
-    // overlapped these boundary values, split the intervals to eliminate
-    // overlap.
-    void getOverlappingIntervals(
-            uint64 start, uint64 end,
-            typename MapType::iterator &first,
-            typename MapType::iterator &it)
+    // Erase all intervals whose values match the predicate
+    template <typename Pred>
+    void    eraseIf(const Pred pred)
     {
-        first = myMap.upper_bound(start);
-        for (it = first; it != myMap.end() && it->second.start < end; )
-        {
-            if (it->second.start < start)
-            {
-                // We used upper_bound so this should always be true
-                assert(it->first > start);
+        myMap.eraseIf([&pred] (const typename MapType::Entry &e)
+                { return pred(e.obj); });
+    }
 
-                myMap[start] = it->second;
-                it->second.start = start;
-            }
-            else if (it->first > end)
-            {
-                myMap[end] = it->second;
-                it->second.start = end;
-            }
-            else
-                ++it;
-        }
+    // Erase all but the keep intervals with the smallest age(value).  Of
+    // the intervals with the cut-off age, only as many as needed are
+    // erased.
+    template <typename Age>
+    void    eraseOldest(size_t keep, const Age age)
+    {
+        if (this->size() <= keep)
+            return;
+
+        std::vector<uint64> ages;
+        ages.reserve(this->size());
+        for (auto it = this->begin(); it != this->end(); ++it)
+            ages.push_back(age(it.value()));
+
+        std::nth_element(ages.begin(), ages.begin() + keep, ages.end());
+
+        const uint64 maxage = ages[keep];
+        size_t       ties = keep - std::count_if(ages.begin(),
+                ages.begin() + keep,
+                [maxage] (uint64 a) { return a < maxage; });
+
+        eraseIf([&] (const T &val) {
+                const uint64 a = age(val);
+                if (a != maxage)
+                    return a > maxage;
+                if (!ties)
+                    return true;
+                ties--;
+                return false;
+            });
     }
 
+private:
     void clearOverlappingIntervals(uint64 start, uint64 end)
     {
-        typename MapType::iterator first, last;
-        getOverlappingIntervals(start, end, first, last);
-        myMap.erase(first, last);
+        myMap.split(start);
+        myMap.split(end);
+        myMap.erase(myMap.upper_bound(start), myMap.upper_bound(end));
     }
 
 private:
-    MapType   &myMap;
+    IntervalMap<T>  &myIntervals;
+    MapType         &myMap;
+    QMutexLocker     myLock;
 };
 
 #define MAP_TYPE(NAME, TYPE) \
@@ -259,14 +649,14 @@ private:
     typedef IntervalMapWriter<TYPE> NAME##Writer;
 
 struct StackInfo {
-    std::string myStr;
-    uint32      myState;
+    InternString myStr;
+    uint32       myState;
 };
 
 struct MMapInfo {
-    std::string myStr;
-    int         myIdx;
-    bool        myMapped;
+    InternString myStr;
+    int          myIdx;
+    bool         myMapped;
 };
 
 MAP_TYPE(StackTraceMap, StackInfo)
@@ -29,12 +29,14 @@
 #include "mv_ipc.h"
 #include "Math.h"
 #include "IntervalMap.h"
+#include "MemoryState.h"
+#include "TraceFile.h"
 #include <unordered_map>
 #include <memory>
 #include <sys/types.h>
 #include <signal.h>
 
-class MemoryState;
+class LocalityReport;
 
 typedef std::shared_ptr<MemoryState> MemoryStateHandle;
 
@@ -48,17 +50,42 @@ public:
 
     bool        openPipe(int argc, char *argv[]);
 
-    void        setZoomState(MemoryState *state)
+    // Request a new zoom state.  Downsampling starts with the pages in the
+    // focus ranges (in the address units of the zoom state), and cancels
+    // any zoom request that is still in progress.
+    void        setZoomState(MemoryState *state,
+                             const MemoryState::RangeList &focus)
                 {
                     QMutexLocker lock(&myPendingLock);
                     myPendingState.reset(state);
+                    myPendingFocus = focus;
+                    myZoomAbort.store(1);
                 }
     void        clearZoomState()
                 {
                     QMutexLocker lock(&myPendingLock);
                     myPendingClear = true;
+                    myZoomAbort.store(1);
                 }
 
+    // Request a seek to a time in seconds when playing back a recorded
+    // trace.  The state is restored from the nearest earlier keyframe, and
+    // the replay isn't complete until the rest has been played back.
+    void        seek(double seconds)
+                {
+                    QMutexLocker lock(&myPendingLock);
+                    myPendingSeek = SYSmax(seconds, 0.0);
+                    myZoomAbort.store(1);
+                    if (myReplay)
+                        myComplete.store(0);
+                }
+
+    // Returns true when playing back a recorded trace
+    bool        isReplay() const { return myReplay.get(); }
+
+    // The recorded time in seconds of the data loaded during playback
+    double      getReplayTime() const { return myReplayTime * 1e-6; }
+
     // Regulates the interval between stack traces
     void        setBlockSize(int size)
                 {
@@ -68,7 +95,23 @@ public:
     MemoryState *getBaseState() const { return myState; }
 
     uint64      getTotalEvents() const { return myTotalEvents; }
-    bool        isComplete() const { return myAbort; }
+
+    // The tool's burst sampling settings.  Event counts are scaled by
+    // getSampling().getScale() to estimate the unsampled counts.
+    const TraceSampling &getSampling() const { return mySampling; }
+
+    // Incremented each time a zoom state has been fully downsampled
+    uint64      getZoomUpdates() const { return myZoomUpdates; }
+    // True once all input has been loaded and any recording is closed.
+    // This doesn't depend on the loader thread exiting, since the thread
+    // keeps running to handle zoom and seek requests.  Everything the
+    // loader thread wrote before completing is visible to the caller, which
+    // LocalityReport::write() relies on.
+    bool        isComplete() const { return myComplete.loadAcquire(); }
+
+    // Collect statistics for a report as events are loaded.  This must be
+    // called before the loader is started.
+    void        setReport(LocalityReport *report) { myReport = report; }
 
     pid_t       getChild() const { return myChild; }
 
@@ -81,34 +124,81 @@ private:
     bool        waitForInput(int timeout_ms);
     bool        loadFromLackey(int max_read);
     bool        loadFromPipe();
+    bool        loadFromFile();
     bool        loadFromSharedMemory();
 
     template <bool with_stacks>
     bool        loadFromTest();
     bool        loadFromTestExtrema();
 
-    bool        loadBlock(const MV_TraceBlock &block);
+    bool        loadBlock(const MV_TraceAddr *addr, uint32 count);
+    bool        loadBlock(const MV_TraceBlock &block)
+                { return loadBlock(block.myAddr, block.myEntries); }
+    void        loadStackTrace(const MV_Header &header, const char *stack);
+
+    // Keyframes hold the memory state, stack traces and mmaps
+    void        saveKeyframe(std::vector<char> &buf) const;
+    bool        loadKeyframe(const char *data, const char *end);
+    void        seekReplay(double seconds);
+
+    // Insert a stack trace, evicting the oldest traces when the store has
+    // grown past myMaxStacks
+    void        addStackTrace(uint64 start, uint64 end,
+                              const StackInfo &info);
     void        loadMMap(const MV_Header &header, const char *buf);
 
     void        timerEvent(QTimerEvent *event);
+    void        incrementTime();
+    // Increment the time once for each tick of recorded time up to time
+    void        advanceReplayTime(uint64 time);
 
 private:
     typedef std::unordered_map<std::string, int> MMapNameMap;
 
     MemoryState          *myState;
     MemoryStateHandle     myZoomState;
+    bool                  myZoomComplete;
     StackTraceMap        *myStackTrace;
+    size_t                myMaxStacks;
     MMapMap              *myMMapMap;
     MMapNameMap           myMMapNames;
     uint64                myTotalEvents;
+    uint64                myZoomUpdates;
+    TraceSampling         mySampling;
     std::string           myPath;
 
     QMutex                myPendingLock;
     std::unique_ptr<MemoryState> myPendingState;
+    MemoryState::RangeList myPendingFocus;
     bool                  myPendingClear;
+    QAtomicInt            myZoomAbort;
+    double                myPendingSeek;
 
     int                   myBlockSize;
 
+    // Receives a copy of everything loaded when recording.  A keyframe is
+    // written once the coded blocks written since the last one are several
+    // times the size of the keyframe.
+    std::unique_ptr<TraceWriter> myRecord;
+    uint64                myKeyframeEvents;
+    uint64                myKeyframeSize;
+    uint64                myKeyframeBlockBytes;
+
+    // Recorded trace being played back.  A speed of 0 plays back as fast
+    // as possible, otherwise it's a multiple of the recorded rate.
+    std::unique_ptr<TraceReader> myReplay;
+    double                myReplaySpeed;
+    uint64                myReplayTime;
+    uint64                myReplayStart;
+    // The state time is driven by the recorded time rather than the timer.
+    // This is the recorded time of the last tick.
+    uint64                myReplayTick;
+    StopWatch             myReplayTimer;
+    std::unique_ptr<TraceDecoder> myDecoder;
+    // Records in the mapped file are packed, so uncoded blocks that aren't
+    // aligned are copied here before loading
+    std::vector<MV_TraceAddr> myReplayBlock;
+
     // Child process
     pid_t        myChild;
     int          myPipeFD;
@@ -127,11 +217,16 @@ private:
         LACKEY,
         MEMVIEW_PIPE,
         PIN,
-        TEST
+        TEST,
+        TRACE_FILE
     };
 
     LoadSource   mySource;
     int          myTestType;
+    // Test sources end after this many events, or never if 0
+    uint64       myTestEvents;
+    LocalityReport *myReport;
+    QAtomicInt   myComplete;
     bool         myAbort;
 };
 
@@ -0,0 +1,124 @@
+/*
+   This file is part of memview, a real-time memory trace visualization
+   application.
+
+   Copyright (C) 2013 Andrew Clinton
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#ifndef LocalityReport_H
+#define LocalityReport_H
+
+#include "Math.h"
+#include "IntervalMap.h"
+#include "mv_ipc.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+// Collects access statistics from the loader for a machine-readable
+// report.  Events are counted per page, and pages are assigned to mapped
+// regions only when the report is written.  The report is a JSON object
+// with totals, per-region and per-thread statistics, the number of
+// distinct pages touched in each interval of events, and the most
+// frequently sampled stack traces.
+class LocalityReport {
+public:
+             LocalityReport(uint64 interval = 1 << 22);
+
+    // Called by the loader thread as events and stack traces arrive
+    void        addBlock(const MV_TraceAddr *addr, uint32 count);
+    void        addStackTrace(const char *stack);
+
+    // Write the report once Loader::isComplete() returns true, which makes
+    // the loader thread's updates visible.  scale multiplies event counts
+    // to account for sampling by the tool, and is recorded in the report.
+    // Returns false if the file couldn't be written.
+    bool        write(const char *path, const MMapMap &mmaps,
+                      double scale) const;
+
+    uint64      getEvents() const { return myEvents; }
+
+private:
+    static const int    thePageBits = 12;
+    static const int    theLineBits = 6;
+
+    struct Counts {
+        Counts() : myReads(0), myWrites(0), myInstrs(0),
+                   myAllocs(0), myFrees(0) {}
+
+        void    add(const Counts &other)
+                {
+                    myReads += other.myReads;
+                    myWrites += other.myWrites;
+                    myInstrs += other.myInstrs;
+                    myAllocs += other.myAllocs;
+                    myFrees += other.myFrees;
+                }
+
+        uint64  myReads;
+        uint64  myWrites;
+        uint64  myInstrs;
+        uint64  myAllocs;
+        uint64  myFrees;
+    };
+
+    struct Page {
+        Page() : myLines(0), myThreads(0), myInterval(0) {}
+
+        Counts  myCounts;
+        // Touched 64-byte lines
+        uint64  myLines;
+        // Threads below 64 that touched the page
+        uint64  myThreads;
+        // One more than the last interval the page was touched in
+        uint64  myInterval;
+    };
+
+    struct Thread {
+        Thread() : myEvents(0), myPages(0) {}
+
+        uint64  myEvents;
+        uint64  myPages;
+    };
+
+    typedef std::unordered_map<uint64, Page> PageMap;
+
+    Page       &getPage(uint64 page);
+    void        touchThread(Page &page, uint64 pagenum, uint32 thread);
+
+private:
+    PageMap                 myPages;
+    Page                   *myLastPage;
+    uint64                  myLastPageNum;
+
+    // Pages touched by threads 64 and above, as (page << MV_ThreadBits) |
+    // thread
+    std::unordered_set<uint64> myHighThreadPages;
+    std::vector<Thread>     myThreads;
+
+    uint64                  myInterval;
+    uint64                  myEvents;
+    std::vector<uint64>     myIntervalPages;
+
+    std::unordered_map<std::string, uint64> myStacks;
+};
+
+#endif
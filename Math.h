@@ -111,6 +111,8 @@ struct Box {
         return isValid();
     }
     bool isValid() const { return h[0] > l[0] && h[1] > l[1]; }
+    bool contains(T x, T y) const
+    { return x >= l[0] && x < h[0] && y >= l[1] && y < h[1]; }
 
     void dump() const
     {
@@ -30,7 +30,10 @@
 #include "IntervalMap.h"
 #include "SparseArray.h"
 #include "mv_ipc.h"
+#include <QAtomicInt>
 #include <memory>
+#include <vector>
+#include <map>
 
 // Storage for the entire memory state.  This is specifically designed to
 // operate without any locking or atomics for the single writer / many
@@ -83,6 +86,9 @@ public:
     static const uint32        theFullLife     = 1 << (32-State::theTimeShift);
     static const uint32        theHalfLife     = theFullLife >> 1;
 
+    // A sorted list of [start, end) address ranges
+    typedef std::vector<std::pair<uint64, uint64> > RangeList;
+
 private:
     static const int        theAllBits = 36;
     static const int        thePageBits = 12;
@@ -164,6 +170,7 @@ public:
 
                     StateArray &state = cache.getState(top);
                     state.setExists(addr);
+                    state.touchPage(addr, myGeneration);
 
                     uint64 last;
                     switch (size)
@@ -204,7 +211,32 @@ public:
                 }
 
     void        incrementTime(StackTraceMap *stacks = 0);
+
+    // Reset all existing pages to the empty state
+    void        clear();
+
+    // Append the time and the contents of all pages to buf.  load()
+    // replaces the state with the saved data, advancing data past it, and
+    // returns false if the data is invalid.
+    void        save(std::vector<char> &buf) const;
+    bool        load(const char *&data, const char *end);
+    // The number of bytes save() would append, without the fixed header
+    uint64      getSaveSize() const
+                { return getPageCount() *
+                    (sizeof(uint64) + getPageSize()*sizeof(State)); }
+
+    // The number of ticks since an access with the given state value,
+    // matching the age used for display in memview.frag.  Stale states
+    // are the oldest.
+    uint32      getAge(uint32 state) const;
     uint32      getTime() const { return myTime; }
+
+    // A counter that is incremented along with the time, and that is used
+    // to stamp modified pages.  Unlike the time this value does not wrap,
+    // but all pages are modified at getFlushGeneration() when the time
+    // wraps.
+    uint32      getGeneration() const { return myGeneration; }
+    uint32      getFlushGeneration() const { return myFlushGeneration; }
     int         getIgnoreBits() const { return myIgnoreBits; }
 
     uint64      getPageCount() const
@@ -217,6 +249,27 @@ public:
         return pagecount;
     }
 
+    // The number of entries in each DisplayPage
+    static uint64 getPageSize() { return 1ull << thePageBits; }
+
+    // Tracks how far a reader has progressed through the page logs, keyed
+    // by the top address bits of each state array
+    typedef std::map<uint64, uint64> PageCursor;
+
+    // Append the addresses of pages that were created since the last call
+    // with the same cursor, in creation order.
+    void        getNewPages(std::vector<uint64> &pages,
+                            PageCursor &cursor) const
+    {
+        for (const LinkItem *it = &myHead; it; it = it->myNext)
+        {
+            uint64 &pos = cursor[it->myTop];
+            uint64  count = it->myState.getPageCount();
+            for (; pos < count; pos++)
+                pages.push_back(it->myTop | it->myState.getLoggedPage(pos));
+        }
+    }
+
     // Print status information for a memory address
     void        appendAddressInfo(QString &message, uint64 addr,
                                   const MMapMap &map);
@@ -302,11 +355,18 @@ public:
         return DisplayIterator(&myHead);
     }
 
-    // Build a mipmap from another memory state
-    void        downsample(const MemoryState &state);
+    // Build a mipmap from another memory state.  Pages overlapping the
+    // focus ranges (in the address units of this state) are downsampled
+    // first, followed by the remaining pages in order of increasing
+    // distance from the focus.  If abort becomes non-zero the downsample
+    // stops early and false is returned.
+    bool        downsample(const MemoryState &state,
+                           const RangeList &focus,
+                           const QAtomicInt *abort = 0);
     void        downsamplePage(const DisplayPage &page, int shift, bool fast);
 
-    // Set a flag that is reset to false when downsample is complete
+    // Set a flag that is reset to false once downsample has completed the
+    // focus pages
     void        setSamplingInProgress() { mySampling = true; }
     bool        isSamplingInProgress() const { return mySampling; }
 
@@ -373,6 +433,8 @@ private:
 private:
     QMutex         myWriteLock;
     uint32         myTime;        // Rolling counter
+    uint32         myGeneration;
+    uint32         myFlushGeneration;
     bool           mySampling;
 
     // The number of low-order bits to ignore.  This value determines the
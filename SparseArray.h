@@ -27,6 +27,8 @@
 
 #include "Math.h"
 #include <sys/mman.h>
+#include <assert.h>
+#include <stdlib.h>
 
 // Storage for a create-on-write array. The array is mapped into memory but
 // does not consume any storage until values are written. This allows
@@ -71,7 +73,11 @@ public:
          size_t dsize = (myTopSize << (bottom_bits-page_bits))*sizeof(bool);
          size_t tsize = myTopSize*sizeof(bool);
 
-         mySize = ssize + tsize + dsize;
+         myPageLogSize = entries >> page_bits;
+         size_t lsize = myPageLogSize*sizeof(uint64);
+         size_t psize = myPageLogSize*sizeof(uint32);
+
+         mySize = ssize + tsize + dsize + lsize + psize;
 
          void *addr = mmap(0, mySize,
                  PROT_WRITE | PROT_READ,
@@ -86,6 +92,8 @@ public:
          myState = (T *)addr;
          myExists = (bool *)((char *)addr + ssize);
          myTopExists = (bool *)((char *)addr + ssize + dsize);
+         myPageLog = (uint64 *)((char *)addr + ssize + dsize + tsize);
+         myPageStamp = (uint32 *)((char *)myPageLog + lsize);
          myPageCount = 0;
      }
     ~SparseArray()
@@ -99,13 +107,31 @@ public:
         {
             myExists[addr >> thePageBits] = true;
             myTopExists[addr >> theBottomBits] = true;
-            myPageCount++;
+
+            // Append to the page log before publishing the new count, so
+            // that a reader never sees an unwritten log entry.
+            uint64 count = myPageCount;
+            if (count < myPageLogSize)
+            {
+                myPageLog[count] = addr & ~thePageMask;
+                __atomic_store_n(&myPageCount, count+1, __ATOMIC_RELEASE);
+            }
         }
     }
 
     // Return the number of pages that have been marked as existing with
     // setExists()
-    uint64 getPageCount() const { return myPageCount; }
+    uint64 getPageCount() const
+    { return __atomic_load_n(&myPageCount, __ATOMIC_ACQUIRE); }
+
+    // Return the address of the i'th page that was created, for i up to
+    // getPageCount().  Pages are logged in creation order.
+    uint64 getLoggedPage(uint64 i) const { return myPageLog[i]; }
+
+    // Record a stamp (such as a generation counter) for the page containing
+    // addr, to allow readers to detect which pages were modified
+    void touchPage(uint64 addr, uint32 stamp)
+    { myPageStamp[addr >> thePageBits] = stamp; }
 
     T              &operator[](uint64 idx) { return myState[idx]; }
     const T        &operator[](uint64 idx) const { return myState[idx]; }
@@ -113,13 +139,15 @@ public:
     // Abstract access to a single page
     class Page {
     public:
-        Page() : myArr(0), myAddr(0) {}
-        Page(T *arr, uint64 addr)
+        Page() : myArr(0), myAddr(0), myStamp(0) {}
+        Page(T *arr, uint64 addr, uint32 stamp)
             : myArr(arr)
-            , myAddr(addr) {}
+            , myAddr(addr)
+            , myStamp(stamp) {}
 
         uint64        addr() const        { return myAddr; }
         uint64        size() const        { return thePageSize; }
+        uint32        stamp() const       { return myStamp; }
 
         T        state(uint64 i) const { return myArr[i]; }
         T        &state(uint64 i) { return myArr[i]; }
@@ -131,6 +159,7 @@ public:
     private:
         T            *myArr;
         uint64        myAddr;
+        uint32        myStamp;
     };
 
     Page        getPage(uint64 addr, uint64 &off) const
@@ -138,8 +167,9 @@ public:
         off = addr;
         addr &= ~thePageMask;
         off -= addr;
-        return Page(myExists[addr >> thePageBits] ?
-                &myState[addr] : 0, addr);
+        if (!myExists[addr >> thePageBits])
+            return Page(0, addr, 0);
+        return Page(&myState[addr], addr, myPageStamp[addr >> thePageBits]);
     }
 
     // A class to iterate over existing pages.
@@ -172,7 +202,8 @@ public:
         Page page() const
         {
             uint64 addr = (myTop << theBottomBits) + myBottom;
-            return Page(&myState.myState[addr], addr);
+            return Page(&myState.myState[addr], addr,
+                    myState.myPageStamp[addr >> thePageBits]);
         }
 
     private:
@@ -205,6 +236,9 @@ private:
     T           *myState;
     bool        *myTopExists;
     bool        *myExists;
+    uint64      *myPageLog;
+    uint32      *myPageStamp;
+    uint64       myPageLogSize;
     uint64       myPageCount;
     size_t       mySize;
     uint64       myTopSize;
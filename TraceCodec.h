@@ -0,0 +1,62 @@
+/*
+   This file is part of memview, a real-time memory trace visualization
+   application.
+
+   Copyright (C) 2013 Andrew Clinton
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#ifndef TraceCodec_H
+#define TraceCodec_H
+
+#include "mv_ipc.h"
+#include "Math.h"
+#include <vector>
+
+// Compression for trace blocks in recorded traces.  Each block is coded
+// independently, so blocks can be decoded in any order.  The type words
+// in a block are replaced by indices into a dictionary of the distinct
+// words.  Each address is predicted from the previous address with the
+// same type word, which includes the thread, and the zigzag-encoded
+// difference is stored as a variable length integer.  Sequential accesses
+// cost 2 bytes per event rather than 12.
+//
+// A coded block is:
+//  uint32      number of entries
+//  uint32      dictionary size
+//  uint32      dictionary of type words
+//  uint8       dictionary index for each entry
+//  varint      address difference for each entry
+class TraceCodec {
+public:
+    // Blocks with more distinct type words than this can't be coded
+    static const uint32 theMaxDictSize = 256;
+
+    // Append the coded block to buf.  Returns false, leaving buf
+    // unchanged, if the block can't be coded.
+    static bool encode(std::vector<char> &buf,
+                       const MV_TraceAddr *addr, uint32 count);
+
+    // Decode a block into addr, which must have room for MV_BlockSize
+    // entries.  Returns the number of entries, or -1 if the data is
+    // invalid.
+    static int  decode(MV_TraceAddr *addr, const char *data, size_t size);
+};
+
+#endif
@@ -0,0 +1,298 @@
+/*
+   This file is part of memview, a real-time memory trace visualization
+   application.
+
+   Copyright (C) 2013 Andrew Clinton
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#ifndef TraceFile_H
+#define TraceFile_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include "mv_ipc.h"
+#include "Math.h"
+#include "StopWatch.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <string.h>
+
+// A recorded trace is a TraceFileHeader followed by a sequence of records
+// in the order they were received by the loader.  Each record is a
+// TraceRecord followed by mySize bytes of payload:
+//  - MV_BLOCK:      MV_TraceAddr[mySize / sizeof(MV_TraceAddr)]
+//  - theTraceCodedBlock: A block compressed by TraceCodec
+//  - MV_STACKTRACE: MV_StackInfo, then the null-terminated stack string
+//  - MV_MMAP:       MV_MMapInfo, then the null-terminated mmap name
+//  - theTraceTime:  uint64 microseconds since recording started, which
+//                   applies to the records that follow
+//  - theTraceKeyframe: TraceKeyframe, then the complete loader state at
+//                   that point (see Loader::saveKeyframe)
+//  - theTraceIndex: TraceKeyframe for each keyframe in the file
+//  - theTraceIndexOffset: uint64 file offset of the index.  This is the
+//                   last record of a recording that was closed cleanly.
+//  - theTraceSample: TraceSampling for a trace of a sampled program.  When
+//                   present this is the first record.
+// Readers skip records of unknown type.  Payloads are not aligned.
+struct TraceFileHeader {
+    char        myMagic[8];
+    uint32      myVersion;
+    uint32      myIgnored;
+};
+
+struct TraceRecord {
+    uint32      myType;
+    uint32      mySize;
+};
+
+static const char   theTraceMagic[8] = { 'M','V','T','R','A','C','E',0 };
+static const uint32 theTraceVersion = 2;
+static const uint32 theTraceTime = 16;
+static const uint32 theTraceKeyframe = 17;
+static const uint32 theTraceIndex = 18;
+static const uint32 theTraceIndexOffset = 19;
+static const uint32 theTraceCodedBlock = 20;
+static const uint32 theTraceSample = 21;
+
+struct TraceKeyframe {
+    uint64      myOffset;       // File offset of the keyframe record
+    uint64      myTime;         // Microseconds since recording started
+    uint64      myEvents;       // Events loaded before the keyframe
+};
+
+// Burst sampling by the tool: myOn events are traced, then myOff events
+// are skipped.  myOn is 0 when every event is traced.
+struct TraceSampling {
+    TraceSampling() : myOn(0), myOff(0) {}
+
+    // Multiply traced event counts by this to estimate the real counts
+    double      getScale() const
+                { return myOn ? (double)(myOn + myOff) / myOn : 1; }
+
+    uint32      myOn;
+    uint32      myOff;
+};
+
+// Helpers to serialize keyframe data
+template <typename T>
+static inline void
+traceAppend(std::vector<char> &buf, const T &val)
+{
+    const char *data = (const char *)&val;
+    buf.insert(buf.end(), data, data + sizeof(T));
+}
+
+static inline void
+traceAppend(std::vector<char> &buf, const std::string &str)
+{
+    traceAppend(buf, (uint32)str.size());
+    buf.insert(buf.end(), str.begin(), str.end());
+}
+
+// These return false when reading past the end of the data
+template <typename T>
+static inline bool
+traceRead(const char *&data, const char *end, T &val)
+{
+    if ((size_t)(end - data) < sizeof(T))
+        return false;
+    memcpy(&val, data, sizeof(T));
+    data += sizeof(T);
+    return true;
+}
+
+static inline bool
+traceRead(const char *&data, const char *end, std::string &str)
+{
+    uint32  size;
+    if (!traceRead(data, end, size) || (size_t)(end - data) < size)
+        return false;
+    str.assign(data, size);
+    data += size;
+    return true;
+}
+
+// Appends records to a trace file.  Records are copied into a memory
+// buffer, and a separate thread compresses the blocks in full buffers and
+// writes them to disk, so the caller never waits on I/O or compression.
+// If the thread can't keep up, the buffer being filled grows rather than
+// blocking the caller.
+class TraceWriter : public QThread {
+public:
+             TraceWriter();
+    // Writes out any buffered records and closes the file
+    virtual ~TraceWriter();
+
+    // Create the file and start the writer thread.  Returns false if the
+    // file couldn't be created.
+    bool        open(const char *path, const TraceSampling &sampling);
+
+    void        writeBlock(const MV_TraceAddr *addr, uint32 count);
+    void        writeStackTrace(const MV_Header &header, const char *stack);
+    void        writeMMap(const MV_Header &header, const char *name);
+
+    // Write a keyframe with the loader state after events have been
+    // loaded.  The state is moved to the writer thread rather than copied.
+    void        writeKeyframe(uint64 events, std::vector<char> &&state);
+
+    // Bytes of block records written to the file so far, after coding.
+    // This lags the blocks passed to writeBlock() by the buffered records.
+    uint64      getBlockBytes() const
+                { return myBlockBytes.load(std::memory_order_relaxed); }
+
+protected:
+    void        run();
+
+private:
+    void        append(uint32 type,
+                       const void *data, size_t size,
+                       const void *extra = 0, size_t extrasize = 0);
+
+    // These are only used by the thread.  Records from a full buffer are
+    // coded into myOut, which is written out in large pieces.
+    void        writeRecords(std::vector<char> &buf);
+    void        writeIndex();
+    void        output(const void *data, size_t size);
+    void        flushOutput();
+    void        writeFile(const char *data, size_t size);
+
+private:
+    // Records are appended to myFill.  Once it passes theBufferSize it is
+    // swapped with myFlush, which is written by the thread.
+    static const size_t theBufferSize = 4 << 20;
+
+    std::vector<char>   myFill;
+    std::vector<char>   myFlush;
+    // Keyframe records in myFill hold only the TraceKeyframe.  The states
+    // are queued here in the same order.
+    std::deque<std::vector<char>>   myKeyframeStates;
+    QMutex              myLock;
+    QWaitCondition      myFlushReady;
+    bool                myFlushing;
+    bool                myDone;
+
+    std::string         myPath;
+    int                 myFD;
+    std::vector<char>   myOut;
+    uint64              myFileBytes;
+    std::atomic<uint64> myBlockBytes;
+    bool                myFailed;
+
+    // Time records are written at most once per millisecond
+    StopWatch           myTimer;
+    uint64              myTime;
+
+    // Written as an index when the file is closed.  The file offsets are
+    // found by the thread.
+    std::vector<TraceKeyframe>  myKeyframes;
+    TraceSampling               mySampling;
+};
+
+// Reads a recorded trace.  The file is mapped into memory, and record
+// payloads are returned in place without copying.
+class TraceReader {
+public:
+             TraceReader();
+    ~TraceReader();
+
+    // Returns false if the file couldn't be mapped or isn't a trace
+    bool        open(const char *path);
+
+    // Get the next record.  Returns false at the end of the trace.
+    bool        nextRecord(TraceRecord &record, const char *&data);
+
+    // Continue reading at a record offset, such as a keyframe.  Offset 0
+    // restarts from the first record.
+    void        seek(uint64 offset);
+
+    // Keyframes in order of time
+    const std::vector<TraceKeyframe> &getKeyframes() const
+                { return myKeyframes; }
+
+    const TraceSampling &getSampling() const { return mySampling; }
+
+private:
+    // Find keyframes from the index, or by reading through the file if
+    // the recording wasn't closed cleanly
+    void        findKeyframes();
+
+private:
+    const char  *myData;
+    size_t       mySize;
+    size_t       myOffset;
+
+    std::vector<TraceKeyframe>  myKeyframes;
+    TraceSampling               mySampling;
+};
+
+// Reads records ahead of the caller, decoding coded blocks in parallel on
+// a thread pool.  Records are returned in file order, with coded blocks
+// returned as decoded MV_BLOCK records.
+class TraceDecoder {
+public:
+             TraceDecoder(TraceReader &reader);
+    ~TraceDecoder();
+
+    // Get the next record.  The data is valid until the next call.
+    // Returns false at the end of the trace or for an invalid block.
+    bool        nextRecord(TraceRecord &record, const char *&data);
+
+    // Discard the records read ahead.  This must be called before seeking
+    // the reader.
+    void        reset();
+
+private:
+    friend class TraceDecodeTask;
+
+    enum SlotState {
+        EMPTY,
+        DECODING,
+        READY,
+        INVALID
+    };
+
+    struct Slot {
+        TraceRecord                 myRecord;
+        const char                 *myData;
+        std::vector<MV_TraceAddr>   myBlock;
+        SlotState                   myState;
+    };
+
+    // Read records into the empty slots from the head onwards, starting a
+    // decode task for each coded block
+    void        fill();
+
+private:
+    TraceReader        &myReader;
+    QThreadPool         myPool;
+    std::vector<Slot>   mySlots;
+    size_t              myHead;
+    bool                myHeadUsed;
+
+    // Guards the slot states, and is signalled when a block is decoded
+    QMutex              myLock;
+    QWaitCondition      myDecoded;
+};
+
+#endif
@@ -35,6 +35,7 @@
 #include "DisplayLayout.h"
 #include "IntervalMap.h"
 #include <queue>
+#include <unordered_map>
 
 class MemViewWidget;
 class MemViewScroll;
@@ -84,7 +85,7 @@ private:
 
     QMenu                *myLayoutMenu;
 
-    static const int      theVisCount = 3;
+    static const int      theVisCount = 4;
     QActionGroup         *myVisGroup;
     QAction              *myVis[theVisCount];
 
@@ -148,6 +149,7 @@ protected:
     virtual void        mouseMoveEvent(QMouseEvent *event);
     virtual void        mouseReleaseEvent(QMouseEvent *event);
     virtual void        wheelEvent(QWheelEvent *event);
+    virtual void        keyPressEvent(QKeyEvent *event);
 
     virtual void        timerEvent(QTimerEvent *event);
 
@@ -162,10 +164,21 @@ protected:
 
     void        paintText();
 
+    // Returns true if the display has changed since the last paint
+    bool        needsRepaint() const;
+
+    // (Re)allocate the state texture and pixel buffers when the image size
+    // has changed
+    void        allocateTexture();
+
+    // Upload the rows of myImage marked in myDirtyRows to the texture
+    void        uploadImage();
+
 private slots:
     void    linear();
     void    block();
     void    hilbert();
+    void    cache();
 
     void    compact();
     void    full();
@@ -189,7 +202,27 @@ private:
     QGLShaderProgram       *myProgram;
     GLuint                  myTexture;
     GLuint                  myColorTexture;
-    GLuint                  myPixelBuffer;
+    GLuint                  myVertexArray;
+    GLuint                  myVertexBuffer;
+
+    // The state texture is uploaded through a ring of pixel buffers, so
+    // that the copy for one frame can proceed while the previous upload is
+    // still in flight.  When buffer storage is available the buffers stay
+    // mapped, and a fence guards each buffer against reuse before its
+    // upload has completed.
+    static const int        thePixelBufferCount = 3;
+    GLuint                  myPixelBuffer[thePixelBufferCount];
+    uint32                 *myPixelBufferData[thePixelBufferCount];
+    GLsync                  myPixelBufferFence[thePixelBufferCount];
+    int                     myPixelBufferIdx;
+    bool                    myTextureStorage;
+    bool                    myBufferStorage;
+    int                     myTextureWidth;
+    int                     myTextureHeight;
+
+    // Rows of myImage (from the top) that have changed since the last
+    // upload
+    std::vector<uint8>      myDirtyRows;
 
     DisplayLayout           myDisplay;
     MemoryState            *myState;
@@ -198,7 +231,21 @@ private:
     std::string             myStackString;
     uint64                  myStackSelection;
     MMapMap                *myMMapMap;
+    // Interval maps collapsed for display at the current zoom
+    IntervalRuns<StackInfo> myStackRuns;
+    IntervalRuns<MMapInfo>  myMMapRuns;
     Loader                 *myLoader;
+    // Values read from the tracee by paintText() on the last frame, keyed
+    // by address.  A value is only read again when the state at its
+    // address has changed.
+    struct PeekValue {
+        uint64  myVal;
+        uint32  myState;
+        bool    myValid;
+    };
+    typedef std::unordered_map<uint64, PeekValue> PeekCache;
+
+    PeekCache               myPeekCache;
     QString                 myEventInfo;
     uint64                  myPrevEvents;
     int                     myZoom;
@@ -208,6 +255,24 @@ private:
     int                     myDisplayDimmer;
     int                     myDataType;
 
+    // The previous frame acts as a cache of gathered pages.  When the view
+    // is unchanged, only pages modified since myFrameGeneration are
+    // gathered again.
+    const MemoryState      *myFrameState;
+    uint32                  myFrameGeneration;
+    int64                   myFrameRoff;
+    int64                   myFrameCoff;
+    bool                    myFrameValid;
+
+    // Frame pacing.  The fast timer only requests a repaint when data has
+    // been loaded since the last paint, or when enough time has passed
+    // since the last change for the colours to have faded.
+    uint64                  myPaintEvents;
+    uint64                  myPaintZoomUpdates;
+    bool                    myPaintSampling;
+    uint32                  myPaintGeneration;
+    uint32                  myChangeGeneration;
+
     struct Velocity {
         Velocity(double a, double b, double t) : x(a), y(b), time(t) {}
         Velocity operator+(const Velocity &v) const
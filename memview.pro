@@ -14,5 +14,5 @@ QMAKE_CFLAGS_RELEASE = -DGL_GLEXT_PROTOTYPES -g -O3
 QMAKE_CXXFLAGS_RELEASE = -DGL_GLEXT_PROTOTYPES -g -O3 -std=c++0x
 
 # Input
-HEADERS += Window.h MemoryState.h Loader.h DisplayLayout.h IntervalMap.h
-SOURCES += main.C window.C MemoryState.C Loader.C DisplayLayout.C IntervalMap.C
+HEADERS += Window.h MemoryState.h Loader.h DisplayLayout.h IntervalMap.h Gather.h ColorRamp.h Headless.h TraceFile.h TraceCodec.h LocalityReport.h
+SOURCES += main.C window.C MemoryState.C Loader.C DisplayLayout.C IntervalMap.C Gather.C ColorRamp.C Headless.C TraceFile.C TraceCodec.C LocalityReport.C
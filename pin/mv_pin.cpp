@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 
 /* ================================================================== */
 // Global variables 
@@ -51,6 +52,30 @@ static unsigned int          theMaxEntries = 1;
 
 static unsigned long long    theTotalEvents = 0;
 
+// Address and thread filters.  Events outside [theTraceLo, theTraceHi) or
+// from threads not marked in theTraceThread never enter the buffer.
+#define MAX_TRACE_THREADS 1024
+
+static bool                  theFilter = false;
+static ADDRINT               theTraceLo = 0;
+static ADDRINT               theTraceHi = ~(ADDRINT)0;
+static bool                  theTraceAllThreads = true;
+static bool                  theTraceThread[MAX_TRACE_THREADS];
+
+// Burst sampling.  Each thread samples its own events, with the state
+// in a SampleData that theSampleReg points to.  myLeft counts down the
+// events in the current burst, and myTraced is nonzero during a traced
+// burst.
+struct SampleData {
+    INT64       myLeft;
+    ADDRINT     myTraced;
+    UINT32      mySeed;
+};
+
+static UINT32                theSampleOn = 0;
+static UINT32                theSampleOff = 0;
+static REG                   theSampleReg = REG_INVALID();
+
 /* ===================================================================== */
 // Command line switches
 /* ===================================================================== */
@@ -66,6 +91,18 @@ KNOB<string>   KnobSharedMem(KNOB_MODE_WRITEONCE,  "pintool",
 KNOB<BOOL>   KnobTraceInstrs(KNOB_MODE_WRITEONCE,  "pintool",
     "trace-instrs", "0", "Trace instruction memory");
 
+KNOB<string>   KnobTraceRange(KNOB_MODE_WRITEONCE,  "pintool",
+    "trace-range", "", "Only trace addresses in lo:hi (hex)");
+
+KNOB<string>   KnobTraceThreads(KNOB_MODE_WRITEONCE,  "pintool",
+    "trace-threads", "", "Only trace the comma-separated thread ids");
+
+KNOB<string>   KnobSample(KNOB_MODE_WRITEONCE,  "pintool",
+    "sample", "", "Trace on:off events in alternating bursts");
+
+KNOB<BOOL>   KnobSampleRandom(KNOB_MODE_WRITEONCE,  "pintool",
+    "sample-random", "0", "Randomize sample burst lengths");
+
 /* ===================================================================== */
 // Utilities
 /* ===================================================================== */
@@ -81,6 +118,57 @@ INT32 Usage()
     return -1;
 }
 
+static bool
+parseFilters()
+{
+    const char  *str = KnobTraceRange.Value().c_str();
+    char        *end;
+
+    if (*str)
+    {
+        theTraceLo = strtoull(str, &end, 16);
+        if (*end != ':')
+            return false;
+        theTraceHi = strtoull(end+1, &end, 16);
+        if (*end || theTraceHi <= theTraceLo)
+            return false;
+        theFilter = true;
+    }
+
+    str = KnobTraceThreads.Value().c_str();
+    if (*str)
+    {
+        theTraceAllThreads = false;
+        for (;;)
+        {
+            unsigned long tid = strtoul(str, &end, 10);
+            if (end == str || tid >= MAX_TRACE_THREADS)
+                return false;
+            theTraceThread[tid] = true;
+            if (!*end)
+                break;
+            if (*end != ',')
+                return false;
+            str = end+1;
+        }
+        theFilter = true;
+    }
+
+    str = KnobSample.Value().c_str();
+    if (*str)
+    {
+        theSampleOn = strtoul(str, &end, 10);
+        if (*end != ':')
+            return false;
+        theSampleOff = strtoul(end+1, &end, 10);
+        if (*end || !theSampleOn || !theSampleOff)
+            return false;
+        theFilter = true;
+    }
+
+    return true;
+}
+
 /* ===================================================================== */
 // Instrumentation callbacks
 /* ===================================================================== */
@@ -146,6 +234,60 @@ VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
     return buf;
 }
 
+static UINT32
+sampleLength(SampleData *sample, UINT32 len)
+{
+    // Uniform in [1, 2*len-1], so the mean length is len
+    if (KnobSampleRandom && len > 1)
+    {
+        sample->mySeed = sample->mySeed*1103515245 + 12345;
+        return 1 + (sample->mySeed >> 8) % (2*len - 1);
+    }
+    return len;
+}
+
+// Returns nonzero when the current sampling burst has run out
+static ADDRINT PIN_FAST_ANALYSIS_CALL
+sampleExpired(SampleData *sample)
+{
+    return --sample->myLeft <= 0;
+}
+
+static VOID PIN_FAST_ANALYSIS_CALL
+sampleToggle(SampleData *sample)
+{
+    while (sample->myLeft <= 0)
+    {
+        sample->myTraced = !sample->myTraced;
+        sample->myLeft += sampleLength(sample,
+                sample->myTraced ? theSampleOn : theSampleOff);
+    }
+}
+
+// Returns nonzero when an access should be traced
+static ADDRINT PIN_FAST_ANALYSIS_CALL
+traceFilter(ADDRINT ea, THREADID tid, SampleData *sample)
+{
+    return sample->myTraced & (ea >= theTraceLo) & (ea < theTraceHi) &
+        (theTraceAllThreads | (tid < MAX_TRACE_THREADS && theTraceThread[tid]));
+}
+
+static VOID
+threadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    SampleData *sample = new SampleData;
+    sample->myLeft = theSampleOn;
+    sample->myTraced = 1;
+    sample->mySeed = getpid() + tid*2654435761u;
+    PIN_SetContextReg(ctxt, theSampleReg, (ADDRINT)sample);
+}
+
+static VOID
+threadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    delete (SampleData *)PIN_GetContextReg(ctxt, theSampleReg);
+}
+
 // Is called for every instruction and instruments reads and writes
 VOID Instruction(INS ins, VOID *v)
 {
@@ -176,10 +318,41 @@ VOID Instruction(INS ins, VOID *v)
         type |= (size << MV_SizeShift) & MV_SizeMask;
         type |= datatype << MV_DataShift;
 
-        INS_InsertFillBuffer(ins, IPOINT_BEFORE, theBuffer,
-                     IARG_MEMORYOP_EA, memOp, offsetof(struct BufferData, ea),
-                     IARG_UINT32, type, offsetof(struct BufferData, type),
-                     IARG_END);
+        if (theSampleOn)
+        {
+            // The countdown is inlined, and only calls out at the end of
+            // a burst
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)sampleExpired,
+                         IARG_FAST_ANALYSIS_CALL,
+                         IARG_REG_VALUE, theSampleReg,
+                         IARG_END);
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)sampleToggle,
+                         IARG_FAST_ANALYSIS_CALL,
+                         IARG_REG_VALUE, theSampleReg,
+                         IARG_END);
+        }
+
+        if (theFilter)
+        {
+            // Only fill the buffer when the inlined filter passes
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)traceFilter,
+                         IARG_FAST_ANALYSIS_CALL,
+                         IARG_MEMORYOP_EA, memOp,
+                         IARG_THREAD_ID,
+                         IARG_REG_VALUE, theSampleReg,
+                         IARG_END);
+            INS_InsertFillBufferThen(ins, IPOINT_BEFORE, theBuffer,
+                         IARG_MEMORYOP_EA, memOp, offsetof(struct BufferData, ea),
+                         IARG_UINT32, type, offsetof(struct BufferData, type),
+                         IARG_END);
+        }
+        else
+        {
+            INS_InsertFillBuffer(ins, IPOINT_BEFORE, theBuffer,
+                         IARG_MEMORYOP_EA, memOp, offsetof(struct BufferData, ea),
+                         IARG_UINT32, type, offsetof(struct BufferData, type),
+                         IARG_END);
+        }
     }
 }
 
@@ -262,6 +435,12 @@ int main(int argc, char *argv[])
         return Usage();
     }
 
+    if (!parseFilters())
+    {
+        cerr << "Error: invalid -trace-range, -trace-threads or -sample" << endl;
+        return Usage();
+    }
+
     std::string shm = KnobSharedMem.Value();
     if (shm.empty())
         return 1;
@@ -299,6 +478,21 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (theFilter)
+    {
+        // The sampling state is reached through a tool register so that
+        // the filter and countdown stay inlined.  Without -sample every
+        // burst is traced.
+        theSampleReg = PIN_ClaimToolRegister();
+        if (!REG_valid(theSampleReg))
+        {
+            cerr << "Error: could not claim a tool register" << endl;
+            return 1;
+        }
+        PIN_AddThreadStartFunction(threadStart, 0);
+        PIN_AddThreadFiniFunction(threadFini, 0);
+    }
+
     INS_AddInstrumentFunction(Instruction, 0);
 
     // Register ImageLoad to be called when an image is loaded
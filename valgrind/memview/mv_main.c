@@ -63,12 +63,93 @@ static int         clo_inpipe = 0;
 static Bool        clo_trace_instrs = False;
 static const char *clo_shared_mem = 0;
 
+// Events outside [clo_trace_lo, clo_trace_hi) or from threads not in
+// clo_trace_threads are dropped before they reach the trace buffer.
+#define MV_MAX_TRACE_THREADS 64
+
+static Bool        clo_trace_range = False;
+static Addr        clo_trace_lo = 0;
+static Addr        clo_trace_hi = ~(Addr)0;
+static ThreadId    clo_trace_threads[MV_MAX_TRACE_THREADS];
+static Int         clo_trace_thread_count = 0;
+
+// Burst sampling traces clo_sample_on events, then skips clo_sample_off
+// events.  With --sample-random the lengths vary around these values.
+static UInt        clo_sample_on = 0;
+static UInt        clo_sample_off = 0;
+static Bool        clo_sample_random = False;
+
+static Bool parse_trace_range(const HChar *str)
+{
+    HChar       *end;
+
+    clo_trace_lo = VG_(strtoull16)(str, &end);
+    if (*end != ':')
+        return False;
+    clo_trace_hi = VG_(strtoull16)(end+1, &end);
+    if (*end || clo_trace_hi <= clo_trace_lo)
+        return False;
+
+    clo_trace_range = True;
+    return True;
+}
+
+static Bool parse_sample(const HChar *str)
+{
+    HChar       *end;
+
+    clo_sample_on = (UInt)VG_(strtoll10)(str, &end);
+    if (*end != ':')
+        return False;
+    clo_sample_off = (UInt)VG_(strtoll10)(end+1, &end);
+    return !*end && clo_sample_on > 0 && clo_sample_off > 0;
+}
+
+static Bool parse_trace_threads(const HChar *str)
+{
+    HChar       *end;
+
+    clo_trace_thread_count = 0;
+    for (;;)
+    {
+        Long    tid = VG_(strtoll10)(str, &end);
+        if (end == str || tid <= 0 ||
+                clo_trace_thread_count == MV_MAX_TRACE_THREADS)
+            return False;
+
+        clo_trace_threads[clo_trace_thread_count++] = (ThreadId)tid;
+        if (!*end)
+            return True;
+        if (*end != ',')
+            return False;
+        str = end+1;
+    }
+}
+
 static Bool mv_process_cmd_line_option(const HChar* arg)
 {
+    const HChar *str;
+
     if VG_INT_CLO(arg, "--pipe",                clo_pipe) {}
     else if VG_INT_CLO(arg, "--inpipe",         clo_inpipe) {}
     else if VG_STR_CLO(arg, "--shared-mem",     clo_shared_mem) {}
     else if VG_BOOL_CLO(arg, "--trace-instrs",  clo_trace_instrs) {}
+    else if VG_STR_CLO(arg, "--trace-range",    str)
+    {
+        if (!parse_trace_range(str))
+            VG_(fmsg_bad_option)(arg, "expected lo:hi hex addresses\n");
+    }
+    else if VG_STR_CLO(arg, "--trace-threads",  str)
+    {
+        if (!parse_trace_threads(str))
+            VG_(fmsg_bad_option)(arg, "expected a list of thread ids\n");
+    }
+    else if VG_STR_CLO(arg, "--sample",         str)
+    {
+        if (!parse_sample(str))
+            VG_(fmsg_bad_option)(arg, "expected on:off event counts\n");
+    }
+    else if VG_BOOL_CLO(arg, "--sample-random", clo_sample_random) {}
     else
         // Malloc wrapping supports --trace-malloc but not other malloc
         // replacement options.
@@ -84,6 +165,10 @@ static void mv_print_usage(void)
             "    --inpipe=<fd>              input pipe from fd [0]\n"
             "    --shared-mem=<file>        shared memory output file [""]\n"
             "    --trace-instrs=yes         trace instruction memory [no]\n"
+            "    --trace-range=<lo>:<hi>    only trace addresses in [lo,hi) [all]\n"
+            "    --trace-threads=<t1,t2..>  only trace the listed threads [all]\n"
+            "    --sample=<on>:<off>        trace on events, then skip off [all]\n"
+            "    --sample-random=yes        randomize sample lengths [no]\n"
             );
 }
 
@@ -115,6 +200,14 @@ static MV_StackInfo          theStackInfo;
 static char                  theStackTrace[MV_STR_BUFSIZE];
 
 static uint32                theThread = 0;
+// Nonzero when the running thread passes --trace-threads and sampling
+// is in a traced burst.  This is tested by the instrumentation.
+static uint32                theTraceEnabled = 1;
+static Bool                  theThreadTraced = True;
+static Bool                  theSampleTraced = True;
+// Events left in the current sampling burst
+static Int                   theSampleLeft = 0;
+static UInt                  theSampleSeed = 0;
 
 static void appendIpDesc(UInt n, DiEpoch ep, Addr ip, void* uu_opaque)
 {
@@ -219,6 +312,11 @@ static void flush_data(void)
 
 static inline void put_data(Addr addr, uint32 type, uint32 size)
 {
+    // The same filter is applied with VEX IR in flushEventsRange().
+    // Allocations are not sampled, so that heap blocks are always shown.
+    if (!theThreadTraced || addr < clo_trace_lo || addr >= clo_trace_hi)
+        return;
+
     if (theEntries >= theMaxEntries)
         flush_data();
 
@@ -243,6 +341,26 @@ static inline void put_wdata(Addr addr, uint32 type, SizeT size)
     }
 }
 
+static UInt sample_length(UInt len)
+{
+    // Uniform in [1, 2*len-1], so the mean length is len
+    if (clo_sample_random && len > 1)
+        return 1 + VG_(random)(&theSampleSeed) % (2*len - 1);
+    return len;
+}
+
+// Called by the instrumentation when the current burst has run out
+static void sample_toggle(void)
+{
+    while (theSampleLeft <= 0)
+    {
+        theSampleTraced = !theSampleTraced;
+        theSampleLeft += sample_length(
+                theSampleTraced ? clo_sample_on : clo_sample_off);
+    }
+    theTraceEnabled = theThreadTraced && theSampleTraced;
+}
+
 /*------------------------------------------------------------*/
 /*--- instrumentation (based on lackey)                    ---*/
 /*------------------------------------------------------------*/
@@ -519,6 +637,24 @@ static IRAtom* assignNew ( IRSB* sb, IRExpr* e )
    array of outstanding events.  */
 static void flushEventsRange(IRSB* sb, Int start, Int size)
 {
+    if (clo_sample_on)
+    {
+        // Count down the events in the current burst, and switch bursts
+        // when it runs out.  Skipped bursts cost only this countdown and
+        // the guards below.
+        IRExpr *left_addr = mkU64((ULong)&theSampleLeft);
+        IRExpr *left = binop(Iop_Sub32,
+                load(ENDIAN, Ity_I32, left_addr), mkU32(size));
+        addStmtToIRSB( sb, IRStmt_Store(ENDIAN, left_addr, left) );
+
+        IRDirty*   di =
+            unsafeIRDirty_0_N(0,
+                "sample_toggle", VG_(fnptr_to_fnentry)( sample_toggle ),
+                mkIRExprVec_0() );
+        di->guard = binop(Iop_CmpLE32S, left, mkU32(0));
+        addStmtToIRSB( sb, IRStmt_Dirty(di) );
+    }
+
     // Conditionally call the flush method if there's not enough room for
     // all the new events.  This may flush an incomplete block.
     IRExpr *entries_addr = mkU64((ULong)&theEntries);
@@ -552,6 +688,15 @@ static void flushEventsRange(IRSB* sb, Int start, Int size)
     // Grab the thread id
     IRExpr *thread = load(ENDIAN, Ity_I32, mkU64((ULong)&theThread));
 
+    // With a filter, each event is stored under a guard and only advances
+    // the entry count when it passes.  Events that fail still take space
+    // in the flush test above, which is harmless.
+    Bool    filter = clo_trace_range || clo_trace_thread_count ||
+                     clo_sample_on;
+    IRExpr *traced = filter ?
+        load(ENDIAN, Ity_I32, mkU64((ULong)&theTraceEnabled)) : 0;
+    IRExpr *count = mkU32(0);
+
     Int        i;
     for (i = start; i < start+size; i++) {
 
@@ -581,6 +726,36 @@ static void flushEventsRange(IRSB* sb, Int start, Int size)
 
         IRStmt *store;
 
+        if (filter)
+        {
+            // pass is 1 if the event is traced, otherwise 0
+            IRExpr *pass = traced;
+            if (clo_trace_range)
+            {
+                IRExpr *lo = unop(Iop_1Uto32,
+                        binop(Iop_CmpLE64U, mkU64(clo_trace_lo), ev->addr));
+                IRExpr *hi = unop(Iop_1Uto32,
+                        binop(Iop_CmpLT64U, ev->addr, mkU64(clo_trace_hi)));
+                pass = binop(Iop_And32, pass, binop(Iop_And32, lo, hi));
+            }
+            IRExpr *guard = binop(Iop_CmpNE32, pass, mkU32(0));
+
+            store = IRStmt_StoreG(ENDIAN, addr, ev->addr, guard);
+            addStmtToIRSB( sb, store );
+
+            store = IRStmt_StoreG(ENDIAN,
+                    binop(Iop_Add64, addr, mkU64(sizeof(uint64))),
+                    data, guard);
+            addStmtToIRSB( sb, store );
+
+            // Advance only past stored entries
+            addr = binop(Iop_Add64, addr,
+                    unop(Iop_32Uto64,
+                        binop(Iop_Mul32, pass, mkU32(sizeof(MV_TraceAddr)))));
+            count = binop(Iop_Add32, count, pass);
+            continue;
+        }
+
         store = IRStmt_Store(ENDIAN, addr, ev->addr);
         addStmtToIRSB( sb, store );
 
@@ -594,10 +769,13 @@ static void flushEventsRange(IRSB* sb, Int start, Int size)
         addr = binop(Iop_Add64, addr, mkU64(sizeof(MV_TraceAddr)-sizeof(uint64)));
     }
 
+    if (!filter)
+        count = mkU32(size);
+
     // Store the new entry count
     IRStmt *entries_store =
         IRStmt_Store(ENDIAN, entries_addr,
-                binop(Iop_Add32, entries, mkU32(size)));
+                binop(Iop_Add32, entries, count));
 
     addStmtToIRSB( sb, entries_store );
 }
@@ -796,6 +974,12 @@ static void mv_post_clo_init(void)
     {
         theBlock = &theBlockData;
     }
+
+    if (clo_sample_on)
+    {
+        theSampleSeed = (UInt)VG_(getpid)();
+        theSampleLeft = sample_length(clo_sample_on);
+    }
 }
 
 static Int
@@ -1115,6 +1299,17 @@ static void mv_die_mem_brk(Addr a, SizeT len)
 static void mv_start_client_code(ThreadId tid, ULong blocks_dispatched)
 {
     theThread = (uint32)tid << MV_ThreadShift;
+
+    if (clo_trace_thread_count)
+    {
+        Int     i;
+
+        theThreadTraced = False;
+        for (i = 0; i < clo_trace_thread_count; i++)
+            if (clo_trace_threads[i] == tid)
+                theThreadTraced = True;
+        theTraceEnabled = theThreadTraced && theSampleTraced;
+    }
 }
 
 static void mv_thread_start(ThreadId tid)